@@ -0,0 +1,67 @@
+#include "image.hpp"
+
+void BitMask::reset(uint32 width, uint32 height)
+{
+    Width = width;
+    Height = height;
+    WordsPerRow = (width + 63) / 64;
+    Words.assign(WordsPerRow * height, 0);
+}
+
+void BitMask::toData(unsigned char *data, unsigned char background, unsigned char foreground)
+{
+    for (uint32 y = 0; y < Height; y++)
+        for (uint32 x = 0; x < Width; x++)
+        {
+            bool set = (Words[y * WordsPerRow + x / 64] >> (x % 64)) & 1;
+            data[y * Width + x] = set ? foreground : background;
+        }
+}
+
+uint32 BitMask::area()
+{
+    uint32 area = 0;
+    for (uint64 word : Words)
+    {
+        area += __builtin_popcountll(word);
+    }
+    return area;
+}
+
+void BitMask::andWith(BitMask &other)
+{
+    for (uint32 i = 0; i < Words.size(); i++)
+    {
+        Words[i] &= other.Words[i];
+    }
+}
+
+void BitMask::orWith(BitMask &other)
+{
+    for (uint32 i = 0; i < Words.size(); i++)
+    {
+        Words[i] |= other.Words[i];
+    }
+}
+
+void BitMask::xorWith(BitMask &other)
+{
+    for (uint32 i = 0; i < Words.size(); i++)
+    {
+        Words[i] ^= other.Words[i];
+    }
+}
+
+uint64 BitMask::shiftedWord(uint32 y, uint32 word, int shift)
+{
+    // Word whose bit i is pixel 64 * word + i + shift of row y, zero outside the row
+    uint64 *row = Words.data() + y * WordsPerRow;
+    int first = (int)word + (shift >= 0 ? shift / 64 : -((63 - shift) / 64));
+    int bits = shift - (first - (int)word) * 64;
+
+    uint64 low = first >= 0 && first < (int)WordsPerRow ? row[first] : 0;
+    if (bits == 0)
+        return low;
+    uint64 high = first + 1 >= 0 && first + 1 < (int)WordsPerRow ? row[first + 1] : 0;
+    return (low >> bits) | (high << (64 - bits));
+}
@@ -0,0 +1,346 @@
+#include "image.hpp"
+
+using std::cout;
+using std::endl;
+
+ConvolutionKernel::ConvolutionKernel(Shape shape, float size)
+{
+    std::vector<float> profile;
+    switch (shape)
+    {
+    case Box:
+    {
+        int width = std::max(1, (int)round(size));
+        profile.assign(width, 1.0f / width);
+        break;
+    }
+    case Gaussian:
+    {
+        if (size <= 0)
+        {
+            profile.assign(1, 1.0f);
+            break;
+        }
+        // Three standard deviations hold all but 0.3% of the weight
+        int radius = std::max(1, (int)ceil(3 * size));
+        float sum = 0;
+        for (int i = -radius; i <= radius; i++)
+        {
+            profile.push_back(exp(-(i * i) / (2.0f * size * size)));
+            sum += profile.back();
+        }
+        for (float &weight : profile)
+        {
+            weight /= sum;
+        }
+        break;
+    }
+    }
+    *this = ConvolutionKernel(profile, profile);
+}
+
+ConvolutionKernel::ConvolutionKernel(float *weights, int width, int height)
+{
+    Width = width;
+    Height = height;
+    Weights.assign(weights, weights + width * height);
+    factorize();
+}
+
+ConvolutionKernel::ConvolutionKernel(std::vector<float> column, std::vector<float> row)
+{
+    Width = row.size();
+    Height = column.size();
+    for (float columnWeight : column)
+        for (float rowWeight : row)
+        {
+            Weights.push_back(columnWeight * rowWeight);
+        }
+    Column = column;
+    Row = row;
+}
+
+bool ConvolutionKernel::separable()
+{
+    return !Row.empty();
+}
+
+void ConvolutionKernel::factorize()
+{
+    // A rank one kernel is its column through the largest weight times its
+    // row through it, scaled down by that weight
+    int pivot = 0;
+    for (int i = 0; i < Width * Height; i++)
+    {
+        if (fabs(Weights[i]) > fabs(Weights[pivot]))
+            pivot = i;
+    }
+    int pivotX = pivot % Width;
+    int pivotY = pivot / Width;
+    float scale = Weights[pivot];
+
+    Column.assign(Height, 0);
+    Row.assign(Width, 0);
+    if (scale == 0)
+        return;
+    for (int y = 0; y < Height; y++)
+    {
+        Column[y] = Weights[y * Width + pivotX];
+    }
+    for (int x = 0; x < Width; x++)
+    {
+        Row[x] = Weights[pivotY * Width + x] / scale;
+    }
+
+    for (int y = 0; y < Height; y++)
+        for (int x = 0; x < Width; x++)
+        {
+            if (fabs(Weights[y * Width + x] - Column[y] * Row[x]) > 1e-5f * fabs(scale))
+            {
+                Column.clear();
+                Row.clear();
+                return;
+            }
+        }
+}
+
+void Image::Convolve(ConvolutionKernel &kernel, ConvolutionMethod method)
+{
+    if (method == ConvolutionAuto)
+    {
+        method = getConvolutionMethod(kernel);
+    }
+    if (method == ConvolutionSeparable && !kernel.separable())
+    {
+        cout << "Kernel is not separable, convolving directly" << endl;
+        method = ConvolutionDirect;
+    }
+
+    std::vector<float> extended;
+    std::vector<float> result(_width * _height);
+    ExtendImage(kernel, extended);
+    switch (method)
+    {
+    case ConvolutionDirect:
+        ConvolveDirect(kernel, extended, result);
+        break;
+    case ConvolutionSeparable:
+        ConvolveSeparable(kernel, extended, result);
+        break;
+    case ConvolutionFrequency:
+        ConvolveFrequency(kernel, extended, result);
+        break;
+    default:
+        break;
+    }
+
+    RunInBands(_height, [&](unsigned long, uint32 firstRow, uint32 lastRow) {
+        for (uint32 i = firstRow * _width; i < lastRow * _width; i++)
+        {
+            float pixel = round(result[i]);
+            _data[i] = pixel < MIN_INTENSITY ? MIN_INTENSITY : (pixel > MAX_INTENSITY ? MAX_INTENSITY : pixel);
+        }
+    });
+    updateHistogram();
+}
+
+Image::ConvolutionMethod Image::getConvolutionMethod(ConvolutionKernel &kernel)
+{
+    // Estimated floating point operations per output pixel. A real FFT of
+    // N samples takes about 2.5 N log2 N, each block needs a forward and an
+    // inverse one plus the spectrum product.
+    double direct = 2.0 * kernel.Width * kernel.Height;
+    double separable = kernel.separable() ? 2.0 * (kernel.Width + kernel.Height) : std::numeric_limits<double>::max();
+
+    uint32 blockWidth, blockHeight, transformWidth, transformHeight;
+    getOverlapAddBlock(kernel.Width, _width + kernel.Width - 1, blockWidth, transformWidth);
+    getOverlapAddBlock(kernel.Height, _height + kernel.Height - 1, blockHeight, transformHeight);
+    double blocks = ceil((double)(_width + kernel.Width - 1) / blockWidth) * ceil((double)(_height + kernel.Height - 1) / blockHeight);
+    double samples = (double)transformWidth * transformHeight;
+    double transform = 2.5 * samples * log2(samples);
+    double frequency = (transform + blocks * (2 * transform + 3 * samples)) / ((double)_width * _height);
+
+    if (separable <= direct && separable <= frequency)
+        return ConvolutionSeparable;
+    return direct <= frequency ? ConvolutionDirect : ConvolutionFrequency;
+}
+
+void Image::ExtendImage(ConvolutionKernel &kernel, std::vector<float> &extended)
+{
+    // Output (x, y) reads extended samples (x, y) to (x + Width - 1, y + Height - 1)
+    uint32 extendedWidth = _width + kernel.Width - 1;
+    uint32 extendedHeight = _height + kernel.Height - 1;
+    int left = kernel.Width - 1 - kernel.Width / 2;
+    int top = kernel.Height - 1 - kernel.Height / 2;
+    extended.resize((size_t)extendedWidth * extendedHeight);
+    RunInBands(extendedHeight, [&](unsigned long, uint32 firstRow, uint32 lastRow) {
+        for (uint32 y = firstRow; y < lastRow; y++)
+        {
+            int sourceY = std::min(std::max((int)y - top, 0), (int)_height - 1);
+            for (uint32 x = 0; x < extendedWidth; x++)
+            {
+                int sourceX = std::min(std::max((int)x - left, 0), (int)_width - 1);
+                extended[(size_t)y * extendedWidth + x] = _data[sourceY * _width + sourceX];
+            }
+        }
+    });
+}
+
+void Image::ConvolveDirect(ConvolutionKernel &kernel, std::vector<float> &extended, std::vector<float> &result)
+{
+    // Each weight is added across a whole row at once, the inner loop is a
+    // multiply add over contiguous samples the compiler vectorizes
+    uint32 extendedWidth = _width + kernel.Width - 1;
+    RunInBands(_height, [&](unsigned long, uint32 firstRow, uint32 lastRow) {
+        for (uint32 y = firstRow; y < lastRow; y++)
+        {
+            float *row = &result[(size_t)y * _width];
+            for (int j = 0; j < kernel.Height; j++)
+            {
+                const float *source = &extended[(size_t)(y + kernel.Height - 1 - j) * extendedWidth];
+                for (int i = 0; i < kernel.Width; i++)
+                {
+                    float weight = kernel.Weights[j * kernel.Width + i];
+                    const float *shifted = source + kernel.Width - 1 - i;
+                    for (uint32 x = 0; x < _width; x++)
+                    {
+                        row[x] += weight * shifted[x];
+                    }
+                }
+            }
+        }
+    });
+}
+
+void Image::ConvolveSeparable(ConvolutionKernel &kernel, std::vector<float> &extended, std::vector<float> &result)
+{
+    uint32 extendedWidth = _width + kernel.Width - 1;
+    uint32 extendedHeight = _height + kernel.Height - 1;
+    std::vector<float> rows((size_t)_width * extendedHeight, 0);
+
+    RunInBands(extendedHeight, [&](unsigned long, uint32 firstRow, uint32 lastRow) {
+        for (uint32 y = firstRow; y < lastRow; y++)
+        {
+            float *row = &rows[(size_t)y * _width];
+            const float *source = &extended[(size_t)y * extendedWidth];
+            for (int i = 0; i < kernel.Width; i++)
+            {
+                float weight = kernel.Row[i];
+                const float *shifted = source + kernel.Width - 1 - i;
+                for (uint32 x = 0; x < _width; x++)
+                {
+                    row[x] += weight * shifted[x];
+                }
+            }
+        }
+    });
+
+    RunInBands(_height, [&](unsigned long, uint32 firstRow, uint32 lastRow) {
+        for (uint32 y = firstRow; y < lastRow; y++)
+        {
+            float *row = &result[(size_t)y * _width];
+            for (int j = 0; j < kernel.Height; j++)
+            {
+                float weight = kernel.Column[j];
+                const float *source = &rows[(size_t)(y + kernel.Height - 1 - j) * _width];
+                for (uint32 x = 0; x < _width; x++)
+                {
+                    row[x] += weight * source[x];
+                }
+            }
+        }
+    });
+}
+
+// Overlap add block along one side and the transform size it needs. Blocks
+// are at least twice the kernel, so blocks two rows apart never overlap.
+void Image::getOverlapAddBlock(int kernelSize, uint32 extent, uint32 &block, uint32 &transform)
+{
+    block = std::min<uint32>(extent, std::max<uint32>(2 * kernelSize, 256));
+    transform = getSmoothSize(block + kernelSize - 1);
+    block = std::min<uint32>(extent, transform - kernelSize + 1);
+}
+
+void Image::ConvolveFrequency(ConvolutionKernel &kernel, std::vector<float> &extended, std::vector<float> &result)
+{
+    uint32 extendedWidth = _width + kernel.Width - 1;
+    uint32 extendedHeight = _height + kernel.Height - 1;
+    uint32 blockWidth, blockHeight, transformWidth, transformHeight;
+    getOverlapAddBlock(kernel.Width, extendedWidth, blockWidth, transformWidth);
+    getOverlapAddBlock(kernel.Height, extendedHeight, blockHeight, transformHeight);
+    size_t samples = (size_t)transformWidth * transformHeight;
+    size_t spectrumSize = (size_t)transformHeight * (transformWidth / 2 + 1);
+
+    // Blocks run in parallel, each transform on a single thread
+    fourier_plan forward = FourierPlans::get(transformHeight, transformWidth, FFTW_FORWARD, FourierPlans::RealToComplex);
+    fourier_plan inverse = FourierPlans::get(transformHeight, transformWidth, FFTW_BACKWARD, FourierPlans::ComplexToReal);
+
+    // Kernel spectrum, with the 1 / samples scaling of the inverse folded in
+    fourier_real *kernelData = (fourier_real *)FOURIER(malloc)(sizeof(fourier_real) * samples);
+    fourier_complex *kernelSpectrum = (fourier_complex *)FOURIER(malloc)(sizeof(fourier_complex) * spectrumSize);
+    memset(kernelData, 0, sizeof(fourier_real) * samples);
+    for (int j = 0; j < kernel.Height; j++)
+        for (int i = 0; i < kernel.Width; i++)
+        {
+            kernelData[j * transformWidth + i] = kernel.Weights[j * kernel.Width + i] / (fourier_real)samples;
+        }
+    FOURIER(execute_dft_r2c)(forward, kernelData, kernelSpectrum);
+    FOURIER(free)(kernelData);
+
+    // Full convolution sample (n, m) lands on output (n - Width + 1, m - Height + 1).
+    // Blocks of one row overlap their neighbours, so a row is handled by a
+    // single thread and even rows run before odd ones.
+    uint32 blockColumns = (extendedWidth + blockWidth - 1) / blockWidth;
+    uint32 blockRows = (extendedHeight + blockHeight - 1) / blockHeight;
+    for (uint32 parity = 0; parity < 2; parity++)
+    {
+        uint32 rowsInPass = (blockRows + 1 - parity) / 2;
+        unsigned long jobs = std::max<unsigned long>(1, std::min<unsigned long>(getThreadCount(), rowsInPass));
+        RunInParallel(jobs, [&](unsigned long job) {
+            fourier_real *blockData = (fourier_real *)FOURIER(malloc)(sizeof(fourier_real) * samples);
+            fourier_complex *blockSpectrum = (fourier_complex *)FOURIER(malloc)(sizeof(fourier_complex) * spectrumSize);
+            for (uint32 blockRow = parity + 2 * job; blockRow < blockRows; blockRow += 2 * jobs)
+                for (uint32 blockColumn = 0; blockColumn < blockColumns; blockColumn++)
+                {
+                    uint32 startX = blockColumn * blockWidth;
+                    uint32 startY = blockRow * blockHeight;
+                    uint32 width = std::min(blockWidth, extendedWidth - startX);
+                    uint32 height = std::min(blockHeight, extendedHeight - startY);
+
+                    memset(blockData, 0, sizeof(fourier_real) * samples);
+                    for (uint32 y = 0; y < height; y++)
+                        for (uint32 x = 0; x < width; x++)
+                        {
+                            blockData[y * transformWidth + x] = extended[(size_t)(startY + y) * extendedWidth + startX + x];
+                        }
+
+                    FOURIER(execute_dft_r2c)(forward, blockData, blockSpectrum);
+                    for (size_t i = 0; i < spectrumSize; i++)
+                    {
+                        fourier_real real = blockSpectrum[i][REAL] * kernelSpectrum[i][REAL] - blockSpectrum[i][IMAGINARY] * kernelSpectrum[i][IMAGINARY];
+                        fourier_real imaginary = blockSpectrum[i][REAL] * kernelSpectrum[i][IMAGINARY] + blockSpectrum[i][IMAGINARY] * kernelSpectrum[i][REAL];
+                        blockSpectrum[i][REAL] = real;
+                        blockSpectrum[i][IMAGINARY] = imaginary;
+                    }
+                    FOURIER(execute_dft_c2r)(inverse, blockSpectrum, blockData);
+
+                    for (uint32 y = 0; y < height + kernel.Height - 1; y++)
+                    {
+                        int outputY = (int)(startY + y) - (kernel.Height - 1);
+                        if (outputY < 0 || outputY >= (int)_height)
+                            continue;
+                        for (uint32 x = 0; x < width + kernel.Width - 1; x++)
+                        {
+                            int outputX = (int)(startX + x) - (kernel.Width - 1);
+                            if (outputX < 0 || outputX >= (int)_width)
+                                continue;
+                            result[outputY * _width + outputX] += blockData[y * transformWidth + x];
+                        }
+                    }
+                }
+            FOURIER(free)(blockSpectrum);
+            FOURIER(free)(blockData);
+        });
+    }
+    FOURIER(free)(kernelSpectrum);
+}
@@ -0,0 +1,43 @@
+#include "image.hpp"
+
+std::mutex FilterBank::_lock;
+LruCache<std::vector<double>, FilterTransfer> FilterBank::_filters(256 * 1024 * 1024);
+
+std::shared_ptr<const FilterTransfer> FilterBank::get(const std::vector<double> &key, const std::function<void(FilterTransfer &)> &build)
+{
+  {
+    std::lock_guard<std::mutex> guard(_lock);
+    std::shared_ptr<const FilterTransfer> cached = _filters.find(key);
+    if (cached != nullptr)
+      return cached;
+  }
+
+  // Build outside the lock so other sizes are not held up, a second
+  // thread building the same filter meanwhile just loses the race
+  std::shared_ptr<FilterTransfer> transfer = std::make_shared<FilterTransfer>();
+  build(*transfer);
+
+  std::lock_guard<std::mutex> guard(_lock);
+  std::shared_ptr<const FilterTransfer> cached = _filters.find(key);
+  if (cached != nullptr)
+    return cached;
+  _filters.insert(key, transfer, transfer->Values.size() * sizeof(float));
+  return transfer;
+}
+
+void FilterBank::setCapacity(size_t bytes)
+{
+  std::lock_guard<std::mutex> guard(_lock);
+  _filters.setCapacity(bytes);
+}
+
+size_t FilterBank::getCapacity()
+{
+  return _filters.getCapacity();
+}
+
+void FilterBank::clear()
+{
+  std::lock_guard<std::mutex> guard(_lock);
+  _filters.clear();
+}
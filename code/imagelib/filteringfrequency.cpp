@@ -6,57 +6,39 @@ using std::endl;
 void Image::FilterInFrequency(Filter Filter, FilterType type, FilterStage stage, double radius, uint16 n)
 {
     cout << "Filter:" << Filter << endl;
-    PadImage(2, 2);
-    ShiftPeriodicity();
+    uint32 originalWidth = _width;
+    uint32 originalHeight = _height;
+    PadImage(getPaddedSize(_width), getPaddedSize(_height));
     DFT();
-    uint32 imgSize = getImageSize();
-    float *filter = new float[imgSize];
+    uint32 spectrumWidth = getSpectrumWidth();
 
-    float max = std::numeric_limits<float>::min();
-    float min = std::numeric_limits<float>::max();
+    std::shared_ptr<const FilterTransfer> transfer = getFilter(Filter, type, radius, n, _width, _height);
+    const float *filter = transfer->Values.data();
+    float max = transfer->Max;
+    float min = transfer->Min;
 
-    for (int y = 0; y < _height; y++)
-        for (int x = 0; x < _width; x++)
+    // Real filter times complex spectrum, taken as interleaved real and
+    // imaginary parts so the loop vectorizes
+    fourier_real *spectrum = (fourier_real *)_complexData;
+    RunInBands(_height, [&](unsigned long, uint32 firstRow, uint32 lastRow) {
+        for (size_t index = (size_t)firstRow * spectrumWidth; index < (size_t)lastRow * spectrumWidth; index++)
         {
-            uint32 index = y * _width + x;
-            double D = sqrt(pow((double)x - (double)_width / 2, 2) + pow((double)y - (double)_height / 2, 2));
-            switch (Filter)
-            {
-            case Ideal:
-                filter[index] = IdealFilter(type, radius, D);
-                break;
-            case Butterworth:
-                filter[index] = ButterworthFilter(type, radius, D, n);
-                break;
-            case Gaussian:
-                filter[index] = GaussianFilter(type, radius, D);
-            default:
-                break;
-            }
-
-            if (filter[index] > max)
-            {
-                max = filter[index];
-            }
-            if (filter[index] < min)
-            {
-                min = filter[index];
-            }
-
-            // Multiply each pixel by filter
-            _complexData[index][REAL] *= filter[index];
-            _complexData[index][IMAGINARY] *= filter[index];
+            spectrum[2 * index] *= filter[index];
+            spectrum[2 * index + 1] *= filter[index];
         }
+    });
 
     if (stage == FilterStandalone)
     {
         uint16 L = pow(2, _bps);
         float filterPixel;
-        for (uint32 i = 0; i < imgSize; i++)
-        {
-            filterPixel = ((L - 1) * (filter[i] - min)) / (max - min);
-            _data[i] = static_cast<unsigned char>((int)round(filterPixel));
-        }
+        for (uint32 y = 0; y < _height; y++)
+            for (uint32 x = 0; x < _width; x++)
+            {
+                uint32 index = getCenteredSpectrumIndex(x, y);
+                filterPixel = ((L - 1) * (filter[index] - min)) / (max - min);
+                _data[y * _width + x] = static_cast<unsigned char>((int)round(filterPixel));
+            }
         updateHistogram();
         return;
     }
@@ -69,10 +51,167 @@ void Image::FilterInFrequency(Filter Filter, FilterType type, FilterStage stage,
     }
 
     IDFT();
-    PadImage(0.5, 0.5);
+    PadImage(originalWidth, originalHeight);
     updateHistogram();
 }
 
+// Same as FilterInFrequency with FilterAppliedFinal on every image. The
+// batch is split between the threads, each transforms its share with one
+// advanced interface plan and applies the filter across it.
+bool Image::FilterInFrequency(std::vector<Image *> &images, Filter filter, FilterType type, double radius, uint16 n)
+{
+    if (images.empty())
+        return true;
+    Image *first = images[0];
+    for (Image *image : images)
+    {
+        if (image->_width != first->_width || image->_height != first->_height)
+        {
+            cout << "Batch filtering needs images of the same size" << endl;
+            return false;
+        }
+    }
+    cout << "Filter:" << filter << " batch of " << images.size() << endl;
+
+    uint32 width = first->_width;
+    uint32 height = first->_height;
+    uint32 paddedWidth = first->getPaddedSize(width);
+    uint32 paddedHeight = first->getPaddedSize(height);
+    uint32 spectrumWidth = paddedWidth / 2 + 1;
+    size_t samples = (size_t)paddedWidth * paddedHeight;
+    size_t spectrumSize = (size_t)paddedHeight * spectrumWidth;
+    std::shared_ptr<const FilterTransfer> transfer = first->getFilter(filter, type, radius, n, paddedWidth, paddedHeight);
+    const float *filterValues = transfer->Values.data();
+
+    unsigned long jobs = std::max<unsigned long>(1, std::min<unsigned long>(first->getThreadCount(), images.size()));
+    first->RunInParallel(jobs, [&](unsigned long job) {
+        size_t firstImage = images.size() * job / jobs;
+        size_t batch = images.size() * (job + 1) / jobs - firstImage;
+        fourier_plan forward = FourierPlans::get(paddedHeight, paddedWidth, FFTW_FORWARD, FourierPlans::RealToComplex, 1, batch);
+        fourier_plan inverse = FourierPlans::get(paddedHeight, paddedWidth, FFTW_BACKWARD, FourierPlans::ComplexToReal, 1, batch);
+        fourier_real *data = (fourier_real *)FOURIER(malloc)(sizeof(fourier_real) * samples * batch);
+        fourier_complex *spectrum = (fourier_complex *)FOURIER(malloc)(sizeof(fourier_complex) * spectrumSize * batch);
+
+        // Padded with zeros at the bottom and right, as PadImage does
+        memset(data, 0, sizeof(fourier_real) * samples * batch);
+        for (size_t b = 0; b < batch; b++)
+        {
+            unsigned char *source = images[firstImage + b]->_data;
+            fourier_real *padded = data + b * samples;
+            for (uint32 y = 0; y < height; y++)
+                for (uint32 x = 0; x < width; x++)
+                {
+                    padded[y * paddedWidth + x] = source[y * width + x];
+                }
+        }
+
+        FOURIER(execute_dft_r2c)(forward, data, spectrum);
+        fourier_real *interleaved = (fourier_real *)spectrum;
+        for (size_t b = 0; b < batch; b++)
+            for (size_t index = 0; index < spectrumSize; index++)
+            {
+                interleaved[2 * (b * spectrumSize + index)] *= filterValues[index];
+                interleaved[2 * (b * spectrumSize + index) + 1] *= filterValues[index];
+            }
+        FOURIER(execute_dft_c2r)(inverse, spectrum, data);
+
+        // Scaled like IDFT, over the whole padded image, then cropped
+        for (size_t b = 0; b < batch; b++)
+        {
+            Image *image = images[firstImage + b];
+            fourier_real *padded = data + b * samples;
+            uint16 L = pow(2, image->_bps);
+            float max = std::numeric_limits<float>::min();
+            for (size_t i = 0; i < samples; i++)
+            {
+                padded[i] = (float)padded[i] / (float)samples;
+                if (padded[i] > max)
+                {
+                    max = padded[i];
+                }
+            }
+            if (L - 1 > max)
+            {
+                max = L - 1;
+            }
+            for (uint32 y = 0; y < height; y++)
+                for (uint32 x = 0; x < width; x++)
+                {
+                    fourier_real value = padded[y * paddedWidth + x];
+                    float pixel = value < 0 ? 0 : (float)value;
+                    pixel = (float)((((float)L - 1.0f) * pixel) / max);
+                    image->_data[y * width + x] = (int)(round(pixel));
+                }
+            image->updateHistogram();
+        }
+
+        FOURIER(free)(spectrum);
+        FOURIER(free)(data);
+    });
+    return true;
+}
+
+// Built once per filter and spectrum size, later calls only multiply
+std::shared_ptr<const FilterTransfer> Image::getFilter(Filter filter, FilterType type, double radius, uint16 n, uint32 width, uint32 height, float scaleX, float scaleY)
+{
+    std::vector<double> key{(double)filter, (double)type, radius, (double)(filter == Butterworth ? n : 0), (double)height, (double)width, scaleX, scaleY};
+    return FilterBank::get(key, [&](FilterTransfer &built) {
+        BuildFilter(filter, type, radius, n, width, height, scaleX, scaleY, built);
+    });
+}
+
+// Transfer function for a width x height transform. Frequencies are scaled
+// by scaleX and scaleY, so a smaller transform can stand in for a larger one.
+void Image::BuildFilter(Filter filter, FilterType type, double radius, uint16 n, uint32 width, uint32 height, float scaleX, float scaleY, FilterTransfer &transfer)
+{
+    uint32 spectrumWidth = width / 2 + 1;
+    transfer.Values.resize((size_t)height * spectrumWidth);
+    float *values = transfer.Values.data();
+
+    // The spectrum is in natural order, frequencies past the middle wrap
+    // around to negative ones. The filters only depend on the distance to
+    // the zero frequency, so rows y and height - y match and only the upper
+    // half is evaluated. Stored columns never pass the middle.
+    uint32 evaluatedRows = height / 2 + 1;
+    std::vector<float> bandMax(getBandCount(evaluatedRows), std::numeric_limits<float>::lowest());
+    std::vector<float> bandMin(getBandCount(evaluatedRows), std::numeric_limits<float>::max());
+    RunInBands(evaluatedRows, [&](unsigned long band, uint32 firstRow, uint32 lastRow) {
+        for (uint32 y = firstRow; y < lastRow; y++)
+        {
+            float dy = y * scaleY;
+            for (uint32 x = 0; x < spectrumWidth; x++)
+            {
+                float dx = x * scaleX;
+                float D = sqrt(dx * dx + dy * dy);
+                float value = 0;
+                switch (filter)
+                {
+                case Ideal:
+                    value = IdealFilter(type, radius, D);
+                    break;
+                case Butterworth:
+                    value = ButterworthFilter(type, radius, D, n);
+                    break;
+                case Gaussian:
+                    value = GaussianFilter(type, radius, D);
+                default:
+                    break;
+                }
+                values[y * spectrumWidth + x] = value;
+                bandMax[band] = std::max(bandMax[band], value);
+                bandMin[band] = std::min(bandMin[band], value);
+            }
+        }
+    });
+    transfer.Max = *std::max_element(bandMax.begin(), bandMax.end());
+    transfer.Min = *std::min_element(bandMin.begin(), bandMin.end());
+
+    for (uint32 y = evaluatedRows; y < height; y++)
+    {
+        memcpy(values + (size_t)y * spectrumWidth, values + (size_t)(height - y) * spectrumWidth, spectrumWidth * sizeof(float));
+    }
+}
+
 float Image::IdealFilter(FilterType type, float D0, float D)
 {
     bool filterPx = type == Low ? true : false;
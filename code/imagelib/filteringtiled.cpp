@@ -0,0 +1,139 @@
+#include "image.hpp"
+
+using std::cout;
+using std::endl;
+
+// Overlap save: each output tile is filtered together with a margin of
+// input around it, the margin absorbs the wrap around of the circular
+// convolution and is dropped again. The result matches FilterInFrequency
+// on the whole image as far as the filter's spatial reach fits the margin,
+// except that values are clamped instead of rescaled by the maximum, which
+// is not known until the last tile. The capped margin bounds the transform
+// of each worker to about (FILTER_TILE_SIZE + 2 FILTER_MAX_MARGIN)^2.
+bool Image::FilterTiffInFrequency(std::string inputFile, std::string outputFile, Filter filter, FilterType type, double radius, uint16 n, uint32 margin, unsigned int threads)
+{
+    if (radius <= 0)
+    {
+        cout << "Filter radius must be positive" << endl;
+        return false;
+    }
+    // Thread count and padding policy for the helpers
+    Image settings;
+    settings.setThreadCount(threads);
+
+    // Margins overlap the neighbouring tiles, the cache decodes each once
+    TiffTileCache input(inputFile);
+    if (!input.isOpen())
+    {
+        return false;
+    }
+    uint32 width = input.getWidth();
+    uint32 height = input.getHeight();
+    if (input.getBitsPerSample() != 8 || input.getChannels() != 1)
+    {
+        cout << "Tiled filtering needs an 8 bit single channel image" << endl;
+        return false;
+    }
+
+    // The radius is in samples of the transform the whole image would get,
+    // tile transforms scale their frequencies to match it
+    uint32 paddedWidth = settings.getPaddedSize(width);
+    uint32 paddedHeight = settings.getPaddedSize(height);
+    if (margin == 0)
+    {
+        // A gaussian of radius D0 in a P sample transform is a gaussian of
+        // P / (2 pi D0) pixels, the sharper filters ring further out
+        double spread = std::max(paddedWidth, paddedHeight) / (2 * M_PI * radius);
+        margin = (uint32)std::min<double>(ceil((filter == Gaussian ? 4 : 8) * spread), FILTER_MAX_MARGIN);
+    }
+    if (margin > (uint32)FILTER_MAX_MARGIN)
+    {
+        cout << "Margin capped at " << FILTER_MAX_MARGIN << endl;
+        margin = FILTER_MAX_MARGIN;
+    }
+    uint32 tileSize = FILTER_TILE_SIZE;
+    uint32 transformWidth = settings.getSmoothSize(tileSize + 2 * margin);
+    uint32 transformHeight = transformWidth;
+    uint32 spectrumWidth = transformWidth / 2 + 1;
+    size_t samples = (size_t)transformWidth * transformHeight;
+    size_t spectrumSize = (size_t)transformHeight * spectrumWidth;
+
+    std::shared_ptr<const FilterTransfer> transfer = settings.getFilter(filter, type, radius, n, transformWidth, transformHeight,
+                                                               (float)paddedWidth / transformWidth, (float)paddedHeight / transformHeight);
+    const float *filterValues = transfer->Values.data();
+
+    TIFF *output = TIFFOpen(outputFile.c_str(), "w");
+    if (output == nullptr)
+    {
+        cout << "Could not create " << outputFile << endl;
+        return false;
+    }
+    TIFFSetField(output, TIFFTAG_IMAGEWIDTH, width);
+    TIFFSetField(output, TIFFTAG_IMAGELENGTH, height);
+    TIFFSetField(output, TIFFTAG_BITSPERSAMPLE, 8);
+    TIFFSetField(output, TIFFTAG_SAMPLESPERPIXEL, 1);
+    TIFFSetField(output, TIFFTAG_PHOTOMETRIC, PHOTOMETRIC_MINISBLACK);
+    TIFFSetField(output, TIFFTAG_PLANARCONFIG, PLANARCONFIG_CONTIG);
+    TIFFSetField(output, TIFFTAG_COMPRESSION, COMPRESSION_LZW);
+    TIFFSetField(output, TIFFTAG_TILEWIDTH, tileSize);
+    TIFFSetField(output, TIFFTAG_TILELENGTH, tileSize);
+
+    // Tiles run in parallel, each transform on a single thread. libtiff
+    // handles are not thread safe, reading and writing take turns.
+    fourier_plan forward = FourierPlans::get(transformHeight, transformWidth, FFTW_FORWARD, FourierPlans::RealToComplex);
+    fourier_plan inverse = FourierPlans::get(transformHeight, transformWidth, FFTW_BACKWARD, FourierPlans::ComplexToReal);
+    uint32 tileColumns = (width + tileSize - 1) / tileSize;
+    uint32 tileRows = (height + tileSize - 1) / tileSize;
+    uint32 tiles = tileColumns * tileRows;
+    std::atomic<uint32> nextTile(0);
+    std::atomic<bool> ok(true);
+    std::mutex outputLock;
+    unsigned long jobs = std::max<unsigned long>(1, std::min<unsigned long>(settings.getThreadCount(), tiles));
+
+    settings.RunInParallel(jobs, [&](unsigned long) {
+        std::vector<unsigned char> region(samples);
+        std::vector<unsigned char> result((size_t)tileSize * tileSize);
+        fourier_real *data = (fourier_real *)FOURIER(malloc)(sizeof(fourier_real) * samples);
+        fourier_complex *spectrum = (fourier_complex *)FOURIER(malloc)(sizeof(fourier_complex) * spectrumSize);
+
+        for (uint32 tile = nextTile++; tile < tiles; tile = nextTile++)
+        {
+            uint32 tileX = tile % tileColumns * tileSize;
+            uint32 tileY = tile / tileColumns * tileSize;
+            if (!input.readRegion((int)tileX - (int)margin, (int)tileY - (int)margin, transformWidth, transformHeight, region.data()))
+                ok = false;
+
+            for (size_t i = 0; i < samples; i++)
+            {
+                data[i] = region[i];
+            }
+            FOURIER(execute_dft_r2c)(forward, data, spectrum);
+            fourier_real *interleaved = (fourier_real *)spectrum;
+            for (size_t i = 0; i < spectrumSize; i++)
+            {
+                interleaved[2 * i] *= filterValues[i];
+                interleaved[2 * i + 1] *= filterValues[i];
+            }
+            FOURIER(execute_dft_c2r)(inverse, spectrum, data);
+
+            // FFTW leaves the result scaled by the number of samples
+            for (uint32 y = 0; y < tileSize; y++)
+                for (uint32 x = 0; x < tileSize; x++)
+                {
+                    float pixel = round(data[(y + margin) * transformWidth + x + margin] / samples);
+                    result[y * tileSize + x] = pixel < settings.MIN_INTENSITY ? settings.MIN_INTENSITY : (pixel > settings.MAX_INTENSITY ? settings.MAX_INTENSITY : pixel);
+                }
+
+            std::lock_guard<std::mutex> guard(outputLock);
+            if (TIFFWriteTile(output, result.data(), tileX, tileY, 0, 0) < 0)
+                ok = false;
+        }
+
+        FOURIER(free)(spectrum);
+        FOURIER(free)(data);
+    });
+
+    TIFFClose(output);
+    cout << "Filtered " << width << "x" << height << " in " << tiles << " tiles with a margin of " << margin << endl;
+    return ok;
+}
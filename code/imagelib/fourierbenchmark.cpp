@@ -0,0 +1,52 @@
+#include "image.hpp"
+#include <chrono>
+
+using std::cout;
+using std::endl;
+
+// Times a frequency filtering round trip under every padding policy.
+// Usage: fourierbenchmark [width height [runs]]
+int main(int argc, char **argv)
+{
+    uint32 width = argc > 2 ? atoi(argv[1]) : 1000;
+    uint32 height = argc > 2 ? atoi(argv[2]) : 750;
+    int runs = argc > 3 ? atoi(argv[3]) : 5;
+
+    const char *names[] = {"none", "minimal", "power of two", "double"};
+    Image::PaddingPolicy policies[] = {Image::PaddingNone, Image::PaddingMinimal, Image::PaddingPowerOfTwo, Image::PaddingDouble};
+
+    // Generated line pattern, the content does not change the cost
+    Image source(width, height, 0.2f, 0.1f);
+
+    for (int policy = 0; policy < 4; policy++)
+    {
+        source.setFourierPadding(policies[policy]);
+        uint32 paddedWidth = source.getPaddedSize(width);
+        uint32 paddedHeight = source.getPaddedSize(height);
+        uint64 pixels = (uint64)paddedWidth * paddedHeight;
+        uint64 spectrum = (uint64)paddedHeight * (paddedWidth / 2 + 1);
+
+        // Padded 8 bit image, FFTW real input, spectrum and filter
+        uint64 memory = pixels * (sizeof(unsigned char) + sizeof(fourier_real)) + spectrum * (sizeof(fourier_complex) + sizeof(float));
+
+        // First run plans the size, keep it out of the timing
+        Image warmup(source);
+        warmup.FilterInFrequency(Image::Gaussian, Image::Low, Image::FilterAppliedFinal, 30);
+
+        double seconds = 0;
+        for (int run = 0; run < runs; run++)
+        {
+            Image image(source);
+            auto start = std::chrono::steady_clock::now();
+            image.FilterInFrequency(Image::Gaussian, Image::Low, Image::FilterAppliedFinal, 30);
+            seconds += std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count();
+        }
+        seconds /= runs;
+
+        cout << names[policy] << ": " << paddedWidth << "x" << paddedHeight
+             << " memory " << memory / (1024.0 * 1024.0) << " MB"
+             << " time " << seconds * 1000 << " ms"
+             << " throughput " << (double)width * height / seconds / 1e6 << " Mpixel/s" << endl;
+    }
+    return 0;
+}
@@ -0,0 +1,92 @@
+#include "image.hpp"
+
+std::mutex FourierPlans::_lock;
+unsigned int FourierPlans::_rigor = FFTW_ESTIMATE;
+bool FourierPlans::_threadsReady = false;
+std::map<std::vector<int>, fourier_plan> FourierPlans::_plans;
+
+fourier_plan FourierPlans::get(int n0, int n1, int direction, Layout layout, int threads, int batch)
+{
+  // The FFTW planner is not thread safe, everything goes through the lock
+  std::lock_guard<std::mutex> guard(_lock);
+  std::vector<int> key{n0, n1, direction, layout, (int)_rigor, threads, batch};
+  auto entry = _plans.find(key);
+  if (entry != _plans.end())
+  {
+    return entry->second;
+  }
+
+  if (!_threadsReady)
+  {
+    FOURIER(init_threads)();
+    _threadsReady = true;
+  }
+  FOURIER(plan_with_nthreads)(threads);
+
+  // Measuring planners overwrite their arrays, so plan on scratch arrays.
+  // Real transforms keep only the n1 / 2 + 1 non redundant columns.
+  // Batches are stored one transform after another.
+  int n[2] = {n0, n1};
+  int size = n0 * n1;
+  int spectrumSize = n0 * (n1 / 2 + 1);
+  fourier_plan plan;
+  if (layout == RealToComplex || layout == ComplexToReal)
+  {
+    fourier_real *real = (fourier_real *)FOURIER(malloc)(sizeof(fourier_real) * size * (size_t)batch);
+    fourier_complex *spectrum = (fourier_complex *)FOURIER(malloc)(sizeof(fourier_complex) * spectrumSize * (size_t)batch);
+    if (layout == RealToComplex)
+      plan = FOURIER(plan_many_dft_r2c)(2, n, batch, real, nullptr, 1, size, spectrum, nullptr, 1, spectrumSize, _rigor);
+    else
+      plan = FOURIER(plan_many_dft_c2r)(2, n, batch, spectrum, nullptr, 1, spectrumSize, real, nullptr, 1, size, _rigor);
+    FOURIER(free)(spectrum);
+    FOURIER(free)(real);
+  }
+  else
+  {
+    fourier_complex *in = (fourier_complex *)FOURIER(malloc)(sizeof(fourier_complex) * size * (size_t)batch);
+    fourier_complex *out = layout == InPlace ? in : (fourier_complex *)FOURIER(malloc)(sizeof(fourier_complex) * size * (size_t)batch);
+    plan = FOURIER(plan_many_dft)(2, n, batch, in, nullptr, 1, size, out, nullptr, 1, size, direction, _rigor);
+    if (out != in)
+    {
+      FOURIER(free)(out);
+    }
+    FOURIER(free)(in);
+  }
+
+  _plans[key] = plan;
+  return plan;
+}
+
+void FourierPlans::setRigor(unsigned int rigor)
+{
+  std::lock_guard<std::mutex> guard(_lock);
+  _rigor = rigor;
+}
+
+unsigned int FourierPlans::getRigor()
+{
+  return _rigor;
+}
+
+bool FourierPlans::loadWisdom(std::string filename)
+{
+  std::lock_guard<std::mutex> guard(_lock);
+  return FOURIER(import_wisdom_from_filename)(filename.c_str()) != 0;
+}
+
+bool FourierPlans::saveWisdom(std::string filename)
+{
+  std::lock_guard<std::mutex> guard(_lock);
+  return FOURIER(export_wisdom_to_filename)(filename.c_str()) != 0;
+}
+
+void FourierPlans::clear()
+{
+  // Wisdom is kept, so plans made again later are found without measuring
+  std::lock_guard<std::mutex> guard(_lock);
+  for (auto &entry : _plans)
+  {
+    FOURIER(destroy_plan)(entry.second);
+  }
+  _plans.clear();
+}
@@ -3,82 +3,76 @@
 using std::cout;
 using std::endl;
 
+// The input is real, so only the non redundant half of the spectrum is
+// computed and stored: _height rows of getSpectrumWidth() columns, in
+// FFTW's natural order with the zero frequency at the top left. Views of
+// the spectrum call ComplexToData themselves.
 void Image::DFT()
 {
   uint32 imgSize = getImageSize();
-  fftw_complex *complexInputData = new fftw_complex[imgSize];
-  _complexData = new fftw_complex[imgSize];
+  fourier_real *realInputData = (fourier_real *)FOURIER(malloc)(sizeof(fourier_real) * imgSize);
+  // A spectrum left by a filter view is replaced
+  FOURIER(free)(_complexData);
+  _complexData = (fourier_complex *)FOURIER(malloc)(sizeof(fourier_complex) * _height * getSpectrumWidth());
 
-  for (uint32 i = 0; i < imgSize; i++)
-  {
-    complexInputData[i][REAL] = _fData[i];
-    complexInputData[i][IMAGINARY] = 0;
-  }
-  delete (_fData);
-
-  fftw_plan DFTPlan = fftw_plan_dft_2d(_width, _height, complexInputData, _complexData, FFTW_FORWARD, FFTW_ESTIMATE);
-  fftw_execute(DFTPlan);
-  fftw_destroy_plan(DFTPlan);
-  delete (complexInputData);
-  fftw_cleanup();
-  ComplexToData(0.3);
+  RunInBands(_height, [&](unsigned long, uint32 firstRow, uint32 lastRow) {
+    for (uint32 i = firstRow * _width; i < lastRow * _width; i++)
+    {
+      realInputData[i] = _data[i];
+    }
+  });
+
+  fourier_plan DFTPlan = FourierPlans::get(_height, _width, FFTW_FORWARD, FourierPlans::RealToComplex, getThreadCount());
+  FOURIER(execute_dft_r2c)(DFTPlan, realInputData, _complexData);
+  FOURIER(free)(realInputData);
 }
 
 void Image::IDFT()
 {
   uint16 L = pow(2, _bps);
   uint32 imgSize = getImageSize();
-  fftw_complex *out = new fftw_complex[imgSize];
+  fourier_real *out = (fourier_real *)FOURIER(malloc)(sizeof(fourier_real) * imgSize);
 
-  fftw_plan IDFT = fftw_plan_dft_2d(_width, _height, _complexData, out, FFTW_BACKWARD, FFTW_ESTIMATE);
-  fftw_execute(IDFT);
-  fftw_destroy_plan(IDFT);
-  delete (_complexData);
-  fftw_cleanup();
-
-  _fData = new float[imgSize];
-  float max = std::numeric_limits<float>::min();
-  float min = std::numeric_limits<float>::max();
-
-  for (uint32 i = 0; i < imgSize; i++)
-  {
-    _fData[i] = (float)out[i][REAL] / (float)imgSize;
-  }
+  fourier_plan IDFT = FourierPlans::get(_height, _width, FFTW_BACKWARD, FourierPlans::ComplexToReal, getThreadCount());
+  FOURIER(execute_dft_c2r)(IDFT, _complexData, out);
+  FOURIER(free)(_complexData);
+  _complexData = nullptr;
 
-  ShiftInversePeriodicity();
-
-  for (uint32 i = 0; i < imgSize; i++)
-  {
-    if (_fData[i] > max)
+  // FFTW leaves the result scaled by the number of samples
+  std::vector<float> bandMax(getBandCount(_height), std::numeric_limits<float>::min());
+  RunInBands(_height, [&](unsigned long band, uint32 firstRow, uint32 lastRow) {
+    for (uint32 i = firstRow * _width; i < lastRow * _width; i++)
     {
-      max = _fData[i];
+      out[i] = (float)out[i] / (float)imgSize;
+      if (out[i] > bandMax[band])
+      {
+        bandMax[band] = out[i];
+      }
     }
-  }
+  });
 
+  float max = *std::max_element(bandMax.begin(), bandMax.end());
   if (L - 1 > max)
   {
     max = L - 1;
   }
 
-  min = 0;
-  
-  for (uint32 i = 0; i < imgSize; i++)
-  {
-    if (_fData[i] < 0)
+  float min = 0;
+
+  RunInBands(_height, [&](unsigned long, uint32 firstRow, uint32 lastRow) {
+    for (uint32 i = firstRow * _width; i < lastRow * _width; i++)
     {
-      _fData[i] = 0;
+      float pixel = out[i] < 0 ? 0 : (float)out[i];
+      pixel = (float)((((float)L - 1.0f) * (pixel - min)) / (max - min));
+      _data[i] = (int)(round(pixel));
     }
-
-    _fData[i] = (float)((((float)L - 1.0f) * (_fData[i] - min)) / (max - min));
-    _data[i] = (int)(round(_fData[i]));
-  }
+  });
+  FOURIER(free)(out);
 }
 
-void Image::PadImage(float xMult, float yMult)
+// Pads with zeros or crops, keeping the top left corner
+void Image::PadImage(uint32 newWidth, uint32 newHeight)
 {
-  uint32 newWidth = (int)(_width * yMult);
-  uint32 newHeight = (int)(_height * xMult);
-
   unsigned char *newData = new unsigned char[newWidth * newHeight * _channels];
   for (uint32 y = 0; y < newHeight; y++)
     for (uint32 x = 0; x < newWidth; x++)
@@ -92,75 +86,145 @@ void Image::PadImage(float xMult, float yMult)
         newData[y * newWidth + x] = 0;
       }
     }
-  delete (_data);
+  releaseData();
   _data = newData;
   _width = newWidth;
   _height = newHeight;
 }
 
-void Image::ShiftPeriodicity(bool hideNegative)
+static bool SmoothSize(uint32 size)
 {
-  _fData = new float[getImageSize()];
-  int shift = 0;
-  for (uint32 y = 0; y < _height; y++)
-    for (uint32 x = 0; x < _width; x++)
+  if (size == 0)
+    return false;
+  for (uint32 factor : {2, 3, 5, 7})
+  {
+    while (size % factor == 0)
     {
-      int index = y * _width + x;
-      shift = ((x + y) % 2 == 0) ? 1 : -1;
-      _fData[index] = _data[index] * shift;
-      if (hideNegative)
-      {
-        _data[index] = _fData[index] > 0 ? _fData[index] : 0;
-      }
-      else
-      {
-        _data[index] = _fData[index];
-      }
+      size /= factor;
     }
+  }
+  return size == 1;
 }
 
-void Image::ShiftInversePeriodicity()
+// Smallest 2, 3, 5, 7 smooth size not below size
+uint32 Image::getSmoothSize(uint32 size)
 {
-  int shift = 0;
-  for (uint32 y = 0; y < _height; y++)
-    for (uint32 x = 0; x < _width; x++)
+  while (!SmoothSize(size))
+  {
+    size++;
+  }
+  return size;
+}
+
+// Transform size for one image side. Sizes are kept even so the centered
+// spectrum view has the zero frequency exactly in the middle.
+uint32 Image::getPaddedSize(uint32 size)
+{
+  // An empty side is padded like a single sample
+  size = std::max<uint32>(size, 1);
+  // Filtering without wrap around needs at least 2 * size - 1 samples
+  uint32 linear = 2 * size - 1;
+  uint32 padded = size + size % 2;
+  switch (_padding)
+  {
+  case PaddingNone:
+    break;
+  case PaddingMinimal:
+    // Sizes with only small prime factors take FFTW's fast code paths
+    padded = linear + linear % 2;
+    while (!SmoothSize(padded))
     {
-      int index = y * _width + x;
-      shift = ((x + y) % 2 == 0) ? 1 : -1;
-      _fData[index] = _fData[index] * shift;
+      padded += 2;
     }
+    break;
+  case PaddingPowerOfTwo:
+    padded = 2;
+    while (padded < linear)
+    {
+      padded *= 2;
+    }
+    break;
+  case PaddingDouble:
+    padded = 2 * size;
+    break;
+  }
+  return padded;
+}
+
+// Multiplies by (-1)^(x+y), which would move the zero frequency to the
+// center. Only shown as a stage, the transforms work in natural order.
+void Image::ShiftPeriodicity()
+{
+  RunInBands(_height, [&](unsigned long, uint32 firstRow, uint32 lastRow) {
+    for (uint32 y = firstRow; y < lastRow; y++)
+      for (uint32 x = 0; x < _width; x++)
+      {
+        // Negative samples are hidden
+        if ((x + y) % 2 != 0)
+        {
+          _data[y * _width + x] = 0;
+        }
+      }
+  });
+}
+
+uint32 Image::getSpectrumWidth()
+{
+  return _width / 2 + 1;
+}
+
+// Index in the stored half spectrum of pixel (x, y) of a view with the
+// zero frequency moved to the center (fftshift)
+uint32 Image::getCenteredSpectrumIndex(uint32 x, uint32 y)
+{
+  uint32 spectrumWidth = getSpectrumWidth();
+  uint32 u = (x + _width / 2) % _width;
+  uint32 v = (y + _height / 2) % _height;
+  // Columns past the stored half mirror the conjugate of (-u, -v)
+  return u < spectrumWidth ? v * spectrumWidth + u : ((_height - v) % _height) * spectrumWidth + (_width - u);
 }
 
 void Image::ComplexToData(float gamma)
 {
-  uint32 imgSize = getImageSize();
   uint16 L = pow(2, _bps);
-  _fData = new float[imgSize];
-  double max = std::numeric_limits<float>::min();
-  double min = std::numeric_limits<float>::max();
+  delete[] _fData;
+  _fData = new float[getImageSize()];
+  std::vector<double> bandMax(getBandCount(_height), std::numeric_limits<float>::min());
+  std::vector<double> bandMin(getBandCount(_height), std::numeric_limits<float>::max());
 
-  for (uint32 i = 0; i < imgSize; i++)
-  {
-    _fData[i] = sqrt(pow(_complexData[i][REAL], 2) + pow(_complexData[i][IMAGINARY], 2));
-    if (_fData[i] < min)
-    {
-      min = _fData[i];
-    }
-    if (_fData[i] > max)
+  RunInBands(_height, [&](unsigned long band, uint32 firstRow, uint32 lastRow) {
+    for (uint32 y = firstRow; y < lastRow; y++)
+      for (uint32 x = 0; x < _width; x++)
+      {
+        uint32 spectrumIndex = getCenteredSpectrumIndex(x, y);
+        uint32 i = y * _width + x;
+        fourier_real real = _complexData[spectrumIndex][REAL];
+        fourier_real imaginary = _complexData[spectrumIndex][IMAGINARY];
+        _fData[i] = sqrt(real * real + imaginary * imaginary);
+        if (_fData[i] < bandMin[band])
+        {
+          bandMin[band] = _fData[i];
+        }
+        if (_fData[i] > bandMax[band])
+        {
+          bandMax[band] = _fData[i];
+        }
+      }
+  });
+
+  double max = *std::max_element(bandMax.begin(), bandMax.end());
+  double min = *std::min_element(bandMin.begin(), bandMin.end());
+
+  // Scaling and the power law in one pass
+  RunInBands(_height, [&](unsigned long, uint32 firstRow, uint32 lastRow) {
+    for (uint32 i = firstRow * _width; i < lastRow * _width; i++)
     {
-      max = _fData[i];
+      _fData[i] = (((float)L - 1.0f) * (_fData[i] - min)) / (max - min);
+      float scaledPixel = _fData[i] / (L - 1);
+      _fData[i] = pow(scaledPixel, gamma) * (L - 1);
+      _data[i] = static_cast<unsigned char>((int)round(_fData[i]));
     }
-  }
-  
-  for (uint32 i = 0; i < imgSize; i++)
-  {
-    _fData[i] = (((float)L - 1.0f) * (_fData[i] - min)) / (max - min);
-  }
-  intensityPowerLawFloat(gamma);
-  for (uint32 i = 0; i < imgSize; i++)
-  {
-    _data[i] = static_cast<unsigned char>((int)round(_fData[i]));
-  }
+  });
 }
 
 void Image::ApplyFourierTransform(Image::FourierStage stage)
@@ -172,16 +236,18 @@ void Image::ApplyFourierTransform(Image::FourierStage stage)
 
 void Image::FourierTransform(Image::FourierStage stage)
 {
-  PadImage(2, 2);
+  uint32 originalWidth = _width;
+  uint32 originalHeight = _height;
+  PadImage(getPaddedSize(_width), getPaddedSize(_height));
   if (stage == Padded)
   {
     cout << "done with fourier after paddding" << endl;
     return;
   }
 
-  ShiftPeriodicity(true);
   if (stage == Shifted)
   {
+    ShiftPeriodicity();
     cout << "done with fourier after shifting" << endl;
     return;
   }
@@ -189,6 +255,7 @@ void Image::FourierTransform(Image::FourierStage stage)
   DFT();
   if (stage == dft)
   {
+    ComplexToData(0.3);
     cout << "done with fourier after dft" << endl;
     return;
   }
@@ -200,7 +267,7 @@ void Image::FourierTransform(Image::FourierStage stage)
     return;
   }
 
-  PadImage(0.5, 0.5);
+  PadImage(originalWidth, originalHeight);
   cout << "done with fourier after returning to original" << endl;
 }
 
@@ -1,5 +1,8 @@
 #include "image.hpp"
 
+#include <thread>
+#include <sys/mman.h>
+
 using std::cout;
 using std::endl;
 
@@ -13,11 +16,33 @@ Image::Image(std::string filename)
   updateHistogram();
 }
 
+Image::Image(std::string filename, BBox region)
+{
+  openFile(filename, region);
+  updateHistogram();
+}
+
+Image::Image(TiffTileCache &tiff, BBox region)
+{
+  loadTiffRegion(tiff, region);
+  updateHistogram();
+}
+
+Image::Image(std::string filename, uint16 level)
+{
+  loadTiff(filename, level);
+  _region.max_x = (float)(_width - 1);
+  _region.max_y = (float)(_height - 1);
+  updateHistogram();
+}
+
 Image::Image(const Image &image, bool rgb)
 {
   _channels = image._channels;
   _bps = image._bps;
   _pixelUnit = image._pixelUnit;
+  _threads = image._threads;
+  _padding = image._padding;
   _width = image._width;
   _height = image._height;
 
@@ -88,9 +113,26 @@ Image::Image(float alphaX, unsigned int width, unsigned int height)
 
 Image::~Image()
 {
-  delete[] _data;
+  releaseData();
+  delete[] _fData;
+  FOURIER(free)(_complexData);
 };
 
+void Image::releaseData()
+{
+  if (_mapping != nullptr)
+  {
+    munmap(_mapping, _mappingSize);
+    _mapping = nullptr;
+    _mappingSize = 0;
+  }
+  else
+  {
+    delete[] _data;
+  }
+  _data = nullptr;
+}
+
 void Image::OutputMetadata()
 {
   cout << "Width: " << _width << endl;
@@ -105,6 +147,8 @@ void Image::CopyFromImage(const Image &image)
   _channels = image._channels;
   _bps = image._bps;
   _pixelUnit = image._pixelUnit;
+  _threads = image._threads;
+  _padding = image._padding;
   _width = image._width;
   _height = image._height;
 
@@ -141,6 +185,25 @@ bool Image::openFile(std::string filename)
   return false;
 };
 
+bool Image::openFile(std::string filename, BBox region)
+{
+  if (filename.substr(filename.find_last_of(".") + 1) == "tif")
+  {
+    TiffTileCache tiff(filename);
+    return loadTiffRegion(tiff, region);
+  }
+  return false;
+}
+
+bool Image::openFileMapped(std::string filename)
+{
+  if (filename.substr(filename.find_last_of(".") + 1) == "tif")
+  {
+    return loadTiff(filename, 0, true);
+  }
+  return openFile(filename);
+}
+
 void Image::SetViewToSingleColor(Color color)
 {
   unsigned char *data;
@@ -161,11 +224,31 @@ void Image::SetViewToSingleColor(Color color)
   SetDataToView(data, 1);
 }
 
+void Image::RunInParallel(unsigned long jobs, const std::function<void(unsigned long)> &job)
+{
+  // Workers persist between calls, see ThreadPool
+  ThreadPool::run(jobs, job);
+}
+
+unsigned long Image::getBandCount(uint32 rows)
+{
+  return std::max<unsigned long>(1, std::min<unsigned long>(getThreadCount(), rows));
+}
+
+void Image::RunInBands(uint32 rows, const std::function<void(unsigned long band, uint32 firstRow, uint32 lastRow)> &job)
+{
+  // One contiguous band of rows per thread
+  unsigned long bands = getBandCount(rows);
+  RunInParallel(bands, [&](unsigned long band) {
+    job(band, (uint32)((uint64)rows * band / bands), (uint32)((uint64)rows * (band + 1) / bands));
+  });
+}
+
 void Image::SetDataToView(unsigned char *data, int channels)
 {
   _channels = channels;
   uint32 imageSize = getImageSize();
-  delete (_data);
+  releaseData();
   _data = new unsigned char[imageSize];
   for (int i = 0; i < imageSize; i++)
   {
@@ -183,4 +266,14 @@ unsigned long Image::getSamplesPerPixel() { return _channels; };
 unsigned long Image::getPixelUnit() { return _pixelUnit; };
 unsigned long Image::getImageSize() { return _width * _height * _channels; }
 BBox Image::getRegion() { return _region; };
+void Image::setThreadCount(unsigned int threads) { _threads = threads; };
+void Image::setFourierPadding(PaddingPolicy padding) { _padding = padding; };
+Image::PaddingPolicy Image::getFourierPadding() { return _padding; };
+unsigned int Image::getThreadCount()
+{
+  if (_threads > 0)
+    return _threads;
+  unsigned int cores = std::thread::hardware_concurrency();
+  return cores > 0 ? cores : 1;
+};
 std::vector<unsigned int> Image::getHistogram() { return _histogram; };
@@ -6,11 +6,35 @@
 #include <string>
 #include <cstring>
 #include <vector>
+#include <atomic>
+#include <functional>
+#include <unordered_map>
 #include <tiffio.h> // Note use of libtiff
 #include <Eigen/LU>
 #include <Eigen/Core>
+#include <map>
+#include <mutex>
+#include <list>
+#include <memory>
+#include <thread>
+#include <deque>
+#include <condition_variable>
 #include <fftw3.h>
 
+// The frequency path runs on fftwf when built with FOURIER_SINGLE_PRECISION
+// (make PRECISION=single), single precision is plenty for 8 and 16 bit data
+#ifdef FOURIER_SINGLE_PRECISION
+typedef float fourier_real;
+typedef fftwf_complex fourier_complex;
+typedef fftwf_plan fourier_plan;
+#define FOURIER(name) fftwf_##name
+#else
+typedef double fourier_real;
+typedef fftw_complex fourier_complex;
+typedef fftw_plan fourier_plan;
+#define FOURIER(name) fftw_##name
+#endif
+
 struct BBox
 {
 	float min_x{0};
@@ -19,13 +43,353 @@ struct BBox
 	float max_y;
 };
 
-class Component
+// Statistics of labeled components, one entry per label. Pixels of a
+// component are those with its label in the Labels image. Labeling a
+// RunLengthMask leaves Labels empty and stores the labels on the runs.
+class ComponentTable
 {
 public:
-	Component(){};
+	ComponentTable(){};
+	void resize(int count);
+	int size();
+
+	std::vector<int> Labels;
+	std::vector<unsigned char> Intensity;
+	std::vector<uint32> Area;
+	std::vector<int> MinX;
+	std::vector<int> MaxX;
+	std::vector<int> MinY;
+	std::vector<int> MaxY;
+	std::vector<float> CentroidX;
+	std::vector<float> CentroidY;
+	std::vector<uint32> Perimeter;
+};
+
+// Sparse contingency matrix of two label images of the same size. For
+// every main label, the side labels it shares pixels with and how many.
+class ComponentOverlap
+{
+public:
+	ComponentOverlap(){};
+	uint32 count(int mainLabel, int sideLabel);
+
+	std::vector<std::vector<std::pair<int, uint32>>> Overlaps;
+};
+
+// Horizontal run of foreground pixels [Start, End) in one row of a mask
+struct MaskRun
+{
+	MaskRun(uint32 start, uint32 end) : Start(start), End(end), Label(0){};
+	uint32 Start;
+	uint32 End;
 	int Label;
-	unsigned char Intensity;
-	std::vector<uint32> Pixels;
+};
+
+// Binary mask stored as runs of foreground pixels, row by row. Runs of
+// row y are Runs[Rows[y]] up to Runs[Rows[y + 1]], sorted and disjoint.
+class RunLengthMask
+{
+public:
+	RunLengthMask(){};
+	void reset(uint32 width, uint32 height);
+	void appendRow(std::vector<MaskRun> &runs);
+	void toData(unsigned char *data, unsigned char background, unsigned char foreground);
+	uint32 area();
+	BBox bounds();
+	void complement(RunLengthMask &result);
+	uint32 flood(uint32 seed, std::vector<bool> &reached, std::vector<uint32> &runs);
+
+	uint32 Width{0};
+	uint32 Height{0};
+	std::vector<uint32> Rows;
+	std::vector<MaskRun> Runs;
+};
+
+// Binary mask packed 64 pixels per word, bit i of word j in a row is
+// pixel 64 * j + i. Rows are padded to whole words with zero bits.
+class BitMask
+{
+public:
+	BitMask(){};
+	void reset(uint32 width, uint32 height);
+	void toData(unsigned char *data, unsigned char background, unsigned char foreground);
+	uint32 area();
+	void andWith(BitMask &other);
+	void orWith(BitMask &other);
+	void xorWith(BitMask &other);
+	uint64 shiftedWord(uint32 y, uint32 word, int shift);
+
+	uint32 Width{0};
+	uint32 Height{0};
+	uint32 WordsPerRow{0};
+	std::vector<uint64> Words;
+};
+
+// Pixels of a structuring element in one row: MinX to MaxX at DY rows from the origin
+struct ElementRun
+{
+	ElementRun(int dy, int minX, int maxX) : DY(dy), MinX(minX), MaxX(maxX){};
+	int DY;
+	int MinX;
+	int MaxX;
+};
+
+// Straight line element from Before steps back to After steps forward along (StepX, StepY)
+struct LineStep
+{
+	LineStep(int stepX, int stepY, int before, int after) : StepX(stepX), StepY(stepY), Before(before), After(after){};
+	int StepX;
+	int StepY;
+	int Before;
+	int After;
+};
+
+// Structuring element for dense morphology, centered on its origin. Shapes
+// built from lines along rows, columns or diagonals are kept as a chain of
+// lines applied one after another, anything else as rows of member pixels.
+class StructuringElement
+{
+public:
+	enum Shape
+	{
+		Disk = 0,
+		Line = 1,
+		Cross = 2
+	};
+	// Size is the radius of a disk, the length of a line or the width of a cross
+	StructuringElement(Shape shape, int size, float degrees = 0);
+	StructuringElement(int XWidth, int YWidth);
+	StructuringElement(unsigned char *mask, int width, int height);
+	int reach();
+
+	std::vector<ElementRun> Runs;
+	std::vector<LineStep> Chain;
+};
+
+// Convolution kernel of Width x Height weights stored by rows, centered on
+// sample (Width / 2, Height / 2). Kernels of rank one also keep a column
+// and a row factor, so they can be applied as two one dimensional passes.
+class ConvolutionKernel
+{
+public:
+	enum Shape
+	{
+		Box = 0,
+		Gaussian = 1
+	};
+	// Size is the width of a box or the standard deviation of a gaussian
+	ConvolutionKernel(Shape shape, float size);
+	ConvolutionKernel(float *weights, int width, int height);
+	ConvolutionKernel(std::vector<float> column, std::vector<float> row);
+	bool separable();
+
+	int Width{0};
+	int Height{0};
+	std::vector<float> Weights;
+	std::vector<float> Column;
+	std::vector<float> Row;
+
+private:
+	void factorize();
+};
+
+// Least recently used cache of shared values, bounded by the sum of their
+// sizes in bytes. Callers do their own locking.
+template <typename Key, typename Value>
+class LruCache
+{
+public:
+	LruCache(size_t capacity) : _capacity(capacity){};
+
+	std::shared_ptr<const Value> find(const Key &key)
+	{
+		auto entry = _entries.find(key);
+		if (entry == _entries.end())
+			return nullptr;
+		_recent.splice(_recent.begin(), _recent, entry->second.Recent);
+		return entry->second.Shared;
+	}
+
+	void insert(const Key &key, std::shared_ptr<const Value> value, size_t size)
+	{
+		_recent.push_front(key);
+		_entries[key] = Entry{_recent.begin(), value, size};
+		_size += size;
+		evict();
+	}
+
+	void setCapacity(size_t bytes)
+	{
+		_capacity = bytes;
+		evict();
+	}
+
+	size_t getCapacity() { return _capacity; }
+	size_t getSize() { return _size; }
+
+	void clear()
+	{
+		_entries.clear();
+		_recent.clear();
+		_size = 0;
+	}
+
+private:
+	struct Entry
+	{
+		typename std::list<Key>::iterator Recent;
+		std::shared_ptr<const Value> Shared;
+		size_t Size;
+	};
+
+	void evict()
+	{
+		// The most recent entry stays even when it alone exceeds the capacity.
+		// Callers hold their own reference, so dropping an entry in use is safe.
+		while (_size > _capacity && _recent.size() > 1)
+		{
+			auto entry = _entries.find(_recent.back());
+			_size -= entry->second.Size;
+			_entries.erase(entry);
+			_recent.pop_back();
+		}
+	}
+
+	size_t _capacity;
+	size_t _size{0};
+	std::list<Key> _recent;
+	std::map<Key, Entry> _entries;
+};
+
+// Process wide pool of worker threads, started on first use and kept until
+// exit. The calling thread runs jobs of its own batch as well, so a job can
+// run a nested batch without waiting for a free worker.
+class ThreadPool
+{
+public:
+	// Runs job(0) to job(jobs - 1) and returns when all of them are done
+	static void run(unsigned long jobs, const std::function<void(unsigned long)> &job);
+	~ThreadPool();
+
+private:
+	struct Batch
+	{
+		const std::function<void(unsigned long)> *Job;
+		unsigned long Jobs;
+		unsigned long Next{0};
+		unsigned long Finished{0};
+	};
+	static ThreadPool &instance();
+	void work();
+	bool runNext(std::unique_lock<std::mutex> &lock, std::shared_ptr<Batch> batch);
+
+	std::mutex _lock;
+	std::condition_variable _wake;
+	std::condition_variable _done;
+	std::deque<std::shared_ptr<Batch>> _batches;
+	std::vector<std::thread> _workers;
+	bool _stopping{false};
+};
+
+// Process wide cache of FFTW plans, each planned once per size, direction,
+// layout and batch size at the configured rigor. Cached plans are run on new
+// arrays, which must come from FOURIER(malloc) so they match the planning
+// alignment.
+class FourierPlans
+{
+public:
+	enum Layout
+	{
+		OutOfPlace = 0,
+		InPlace = 1,
+		RealToComplex = 2,
+		ComplexToReal = 3
+	};
+	static fourier_plan get(int n0, int n1, int direction, Layout layout, int threads = 1, int batch = 1);
+	static void setRigor(unsigned int rigor);
+	static unsigned int getRigor();
+	static bool loadWisdom(std::string filename);
+	static bool saveWisdom(std::string filename);
+	static void clear();
+
+private:
+	static std::mutex _lock;
+	static unsigned int _rigor;
+	static bool _threadsReady;
+	static std::map<std::vector<int>, fourier_plan> _plans;
+};
+
+// Transfer function of a frequency filter over the stored half spectrum
+struct FilterTransfer
+{
+	std::vector<float> Values;
+	float Min{0};
+	float Max{0};
+};
+
+// Process wide cache of filter transfer functions, each built once per
+// filter, type, radius, order and spectrum size. The least recently used
+// are dropped once the cache holds more than its capacity in bytes.
+class FilterBank
+{
+public:
+	static std::shared_ptr<const FilterTransfer> get(const std::vector<double> &key, const std::function<void(FilterTransfer &)> &build);
+	static void setCapacity(size_t bytes);
+	static size_t getCapacity();
+	static void clear();
+
+private:
+	static std::mutex _lock;
+	static LruCache<std::vector<double>, FilterTransfer> _filters;
+};
+
+// Full or reduced resolution image of a pyramidal tiff, in its directory
+struct TiffLevel
+{
+	TiffLevel(tdir_t directory, uint32 width, uint32 height) : Directory(directory), Width(width), Height(height){};
+	tdir_t Directory;
+	uint32 Width;
+	uint32 Height;
+};
+
+// Tiff opened for random access. Only the metadata is read up front, the
+// tiles or strips a region touches are decoded on demand and kept until the
+// cache holds more than its capacity in bytes, least recently used first.
+// Cached chunks take at most the capacity, or one chunk when that alone is
+// larger, plus the chunks callers still hold. Strips are decoded at most
+// MAX_STRIP_BYTES at a time, so for striped files that bound does not grow
+// with the image. Tiles are as large as the file makes them.
+class TiffTileCache
+{
+public:
+	static const uint32 MAX_STRIP_BYTES = 4 * 1024 * 1024;
+	TiffTileCache(std::string filename, size_t capacity = 64 * 1024 * 1024, uint16 level = 0);
+	~TiffTileCache();
+	bool isOpen();
+	bool readRegion(int x, int y, uint32 width, uint32 height, unsigned char *region);
+	uint32 getWidth();
+	uint32 getHeight();
+	uint16 getChannels();
+	uint16 getBitsPerSample();
+	void setCapacity(size_t bytes);
+	size_t getCapacity();
+
+private:
+	std::shared_ptr<const std::vector<unsigned char>> getChunk(uint32 chunk);
+	TIFF *_tiff{nullptr};
+	uint32 _width{0};
+	uint32 _height{0};
+	uint16 _channels{1};
+	uint16 _bps{8};
+	uint32 _chunkWidth{0};
+	uint32 _chunkHeight{0};
+	uint32 _chunkColumns{1};
+	// Chunks are bands of scanlines rather than whole strips
+	bool _scanlines{false};
+	uint32 _stripRows{0};
+	uint32 _nextRow{0};
+	std::mutex _lock;
+	LruCache<uint32, std::vector<unsigned char>> _chunks;
 };
 
 class Image
@@ -34,6 +398,11 @@ public:
 	Image();
 	Image(const Image &, bool rgb = false);
 	Image(std::string filename);
+	// Only the pixels inside region, which keeps its place in the file
+	Image(std::string filename, BBox region);
+	Image(TiffTileCache &tiff, BBox region);
+	// Level 0 is the full resolution, see getTiffLevels
+	Image(std::string filename, uint16 level);
 	Image(std::string filename1, std::string filename2, std::string filename3);
 	Image(BBox box);
 	Image(unsigned int width, unsigned int height, float pixelUnit);
@@ -74,6 +443,14 @@ public:
 		Final = 4
 	};
 	void ApplyFourierTransform(Image::FourierStage stage);
+	// Size the image is padded to before transforming
+	enum PaddingPolicy
+	{
+		PaddingNone = 0,	   // Periodic filtering, only rounded up to an even size
+		PaddingMinimal = 1,	   // Linear convolution size rounded up to a fast 2, 3, 5, 7 smooth size
+		PaddingPowerOfTwo = 2, // Linear convolution size rounded up to a power of two
+		PaddingDouble = 3	   // Twice the size in each direction
+	};
 	// Filtering in frequency space
 	enum Filter
 	{
@@ -93,6 +470,49 @@ public:
 		FilterAppliedFinal = 2
 	};
 	void FilterInFrequency(Filter Filter, FilterType type, FilterStage stage, double radius, uint16 n = 0);
+	static bool FilterInFrequency(std::vector<Image *> &images, Filter filter, FilterType type, double radius, uint16 n = 0);
+	// Filters an 8 bit grey TIFF into a tiled TIFF one tile at a time, so
+	// memory does not grow with the image. Margin 0 derives it from the
+	// filter. Margins are capped at FILTER_MAX_MARGIN, filters reaching
+	// further are cut off there. Threads 0 uses all cores.
+	static const int FILTER_TILE_SIZE = 512;
+	static const int FILTER_MAX_MARGIN = 1024;
+	static bool FilterTiffInFrequency(std::string inputFile, std::string outputFile, Filter filter, FilterType type, double radius, uint16 n = 0, uint32 margin = 0, unsigned int threads = 0);
+
+	// Spatial convolution, edges are extended by replication
+	enum ConvolutionMethod
+	{
+		ConvolutionAuto = 0,	   // Cheapest of the others by estimated operations per pixel
+		ConvolutionDirect = 1,	   // Every weight, for small kernels
+		ConvolutionSeparable = 2,  // Column then row pass, for rank one kernels
+		ConvolutionFrequency = 3   // FFT overlap add, for large kernels
+	};
+	void Convolve(ConvolutionKernel &kernel, ConvolutionMethod method = ConvolutionAuto);
+	ConvolutionMethod getConvolutionMethod(ConvolutionKernel &kernel);
+
+	// Grayscale morphology on one channel of width x height pixels
+	enum MorphologyOperator
+	{
+		MorphologyOpening = 0,
+		MorphologyClosing = 1,
+		MorphologyTopHat = 2,
+		MorphologyBlackTopHat = 3,
+		MorphologyGradient = 4
+	};
+	void Erosion(unsigned char *data, StructuringElement &element);
+	void Dilation(unsigned char *data, StructuringElement &element);
+	void Morphology(unsigned char *data, StructuringElement &element, MorphologyOperator op);
+	void HitOrMiss(unsigned char *data, StructuringElement &hit, StructuringElement &miss);
+	// Binary morphology on run-length and bit-packed masks, pixels outside
+	// the image are 0
+	void Treshold(unsigned char *data, int treshold, RunLengthMask &mask);
+	void Erosion(RunLengthMask &mask, int XWidth, int YWidth);
+	void Dilation(RunLengthMask &mask, int width);
+	void Treshold(unsigned char *data, int treshold, BitMask &mask);
+	void Erosion(BitMask &mask, int XWidth, int YWidth);
+	void Dilation(BitMask &mask, int width);
+	void Opening(BitMask &mask, int width);
+	void Closing(BitMask &mask, int width);
 
 	//Image Processing
 	enum FISHStage
@@ -106,6 +526,7 @@ public:
 		LiquidSegmentation = 0
 	};
 	const int HIGHLIGHT_INTENSITY = 100;
+	const int NUCLEI_SPLIT_DEPTH = 5;
 	void FISHSignalCounts(FISHStage stage);
 	const int CIRCUIT_BACKGROUND_INTENSITY = 128;
 	const int WIRE_INTENSITY = 64;
@@ -121,6 +542,18 @@ public:
 	virtual ~Image();
 	// File related
 	bool openFile(std::string filename);
+	bool openFile(std::string filename, BBox region);
+	// Maps uncompressed 8 bit tiffs instead of reading them, pages are only
+	// copied once written to and the file itself never changes. Other files
+	// are loaded as usual.
+	bool openFileMapped(std::string filename);
+	// Levels of a pyramidal tiff from the largest down, masks are skipped
+	static std::vector<TiffLevel> getTiffLevels(std::string filename);
+	static std::vector<TiffLevel> getTiffLevels(TIFF *tiff);
+	// Tiled and compressed, with levels of half the size down to one tile
+	// when pyramid is set
+	const int PYRAMID_TILE_SIZE = 256;
+	bool saveTiff(std::string filename, bool pyramid = false);
 	// Image related
 	unsigned char *getImageData();
 	// Get attributes
@@ -134,6 +567,12 @@ public:
 	unsigned long getImageSize();
 	std::vector<unsigned int> getHistogram();
 	BBox getRegion();
+	// Worker threads used by parallel operations, 0 uses all cores
+	void setThreadCount(unsigned int threads);
+	unsigned int getThreadCount();
+	void setFourierPadding(PaddingPolicy padding);
+	PaddingPolicy getFourierPadding();
+	uint32 getPaddedSize(uint32 size);
 
 private:
 	unsigned long _width{0};
@@ -142,6 +581,8 @@ private:
 	unsigned long _channels{0};
 	unsigned long _bps{0};
 	unsigned long _pixelUnit{0};
+	unsigned int _threads{0};
+	PaddingPolicy _padding{PaddingMinimal};
 	float *_lookupTable = new float[256];
 	std::vector<unsigned int> _histogram = std::vector<unsigned int>(256, 0);
 
@@ -151,16 +592,24 @@ private:
 	unsigned char *_blueData{nullptr};
 	int *_components{nullptr};
 	float *_fData{nullptr};
-	fftw_complex *_complexData{nullptr};
+	fourier_complex *_complexData{nullptr};
+	// Set when _data points into a mapped file rather than an allocation
+	void *_mapping{nullptr};
+	size_t _mappingSize{0};
+	void releaseData();
 
 	BBox _region;
 	// Tiff related stuff
-	bool loadTiff(std::string filename);
+	bool loadTiff(std::string filename, uint16 level = 0, bool mapped = false);
 	bool saveTiff();
-	bool readTiffMetaData(TIFF *tiff);
+	bool writeTiffLevel(TIFF *tiff, unsigned char *data, uint32 width, uint32 height, bool reduced);
+	bool readTiffMetaData(TIFF *tiff, tdir_t directory = 0);
+	bool checkTiffLayout(TIFF *tiff);
 	bool loadTiffTiled(TIFF *tiff);
 	bool loadTiffStrip(TIFF *tiff);
-	bool loadTiffScanline(TIFF *tiff);
+	bool mapTiff(std::string filename, TIFF *tiff);
+	bool loadTiffRegion(TiffTileCache &tiff, BBox region);
+	bool readTiffChunks(TIFF *tiff, uint32 chunks, const std::function<bool(TIFF *handle, unsigned long job, uint32 chunk)> &read);
 	// Jpeg related stuff
 	bool loadJpeg(std::string filename);
 	bool loadJpegImageFile(char *lpFilename);
@@ -183,10 +632,11 @@ private:
 	void FourierTransform(Image::FourierStage stage);
 	void DFT();
 	void IDFT();
-	void PadImage(float xMult, float yMult);
-	void ShiftPeriodicity(bool hideNegative = false);
-	void ShiftInversePeriodicity();
+	void PadImage(uint32 newWidth, uint32 newHeight);
+	void ShiftPeriodicity();
 	void ComplexToData(float gamma);
+	uint32 getSpectrumWidth();
+	uint32 getCenteredSpectrumIndex(uint32 x, uint32 y);
 	// Image generation
 	void generateLineImage(float alphaXMultiplier, float alphaYMultiplier);
 	void generateCircleImage(float alphaXMultiplier);
@@ -194,7 +644,16 @@ private:
 	float IdealFilter(FilterType type, float D0, float D);
 	float ButterworthFilter(FilterType type, float D0, float D, int n);
 	float GaussianFilter(FilterType type, float D0, float D);
+	std::shared_ptr<const FilterTransfer> getFilter(Filter filter, FilterType type, double radius, uint16 n, uint32 width, uint32 height, float scaleX = 1, float scaleY = 1);
+	void BuildFilter(Filter filter, FilterType type, double radius, uint16 n, uint32 width, uint32 height, float scaleX, float scaleY, FilterTransfer &transfer);
 	void MedianFilter(uint32 x, uint32 y, int filterWidth);
+	// Convolution backends, reading the image extended by the kernel size
+	void ExtendImage(ConvolutionKernel &kernel, std::vector<float> &extended);
+	void ConvolveDirect(ConvolutionKernel &kernel, std::vector<float> &extended, std::vector<float> &result);
+	void ConvolveSeparable(ConvolutionKernel &kernel, std::vector<float> &extended, std::vector<float> &result);
+	void ConvolveFrequency(ConvolutionKernel &kernel, std::vector<float> &extended, std::vector<float> &result);
+	void getOverlapAddBlock(int kernelSize, uint32 extent, uint32 &block, uint32 &transform);
+	uint32 getSmoothSize(uint32 size);
 	void RemoveSaltandPepper();
 
 	//Mathematical Morphology
@@ -202,26 +661,50 @@ private:
 	const int MIN_INTENSITY = 0;
 	void Erosion(unsigned char *data, int XWidth, int YWidth);
 	void Dilation(unsigned char *data, int width);
+	void ApplyElement(unsigned char *data, uint32 width, uint32 height, StructuringElement &element, bool maximum, unsigned char pad);
+	void ApplyLine(unsigned char *data, uint32 width, uint32 height, LineStep &step, bool maximum, unsigned char pad);
+	void MorphologyInBands(unsigned char *data, int margin, const std::function<void(unsigned char *, unsigned char *, uint32)> &operation);
 	//Segmentation
 	void Treshold(unsigned char *data, int treshold);
 	void TresholdReverse(unsigned char *data, int treshold);
-	void CCL(unsigned char *data, int *labels, std::vector<Component> &components);
-	//void LabelComponent(unsigned char *data, int labelNo, uint32 x, uint32 y);
-	void LabelComponent(unsigned char *data, int *labels, Component &component, uint32 x, uint32 y);
-	void FillHoles(unsigned char *data, int *labels, int componentToSkip);
-	bool ComponentInsideComponent(Component &outsideComponent, Component &insideComponent);
-	bool ComponentsIntersect(Component &mainComponent, Component &sideComponent);
-	bool ComponentCenteredInsideComponent(Component &mainComponent, Component &insideComponent, int deltaError);
-	void GetComponentBoundaries(Component &component, int &minX, int &maxX, int &minY, int &maxY);
-	void RemoveSmallComponents(std::vector<Component> &components, unsigned char *data, int size);
+	enum Connectivity
+	{
+		N4 = 0,
+		N8 = 1
+	};
+	void CCL(unsigned char *data, ComponentTable &components, Connectivity connectivity = N4);
+	void LabelRows(unsigned char *data, std::atomic<int> *parent, uint32 firstRow, uint32 lastRow, Connectivity connectivity);
+	void MergeRows(unsigned char *data, std::atomic<int> *parent, uint32 row, Connectivity connectivity);
+	void CCL(RunLengthMask &mask, ComponentTable &components, Connectivity connectivity = N4);
+	void FillHoles(RunLengthMask &mask);
+	void FillHoles(unsigned char *data);
+	void ReconstructByDilation(unsigned char *marker, unsigned char *mask, Connectivity connectivity = N4);
+	void DistanceTransform(unsigned char *data, float *distance);
+	void Watershed(float *relief, unsigned char *mask, std::vector<int> &labels);
+	void SplitComponents(unsigned char *data, int depth);
+	void PaintComponent(unsigned char *data, ComponentTable &components, int label, int intensity);
+	void PaintComponent(unsigned char *data, RunLengthMask &mask, int label, int intensity);
+	void OverlapComponents(ComponentTable &mainComponents, ComponentTable &sideComponents, ComponentOverlap &overlap);
+	void OverlapComponents(RunLengthMask &mainMask, RunLengthMask &sideMask, ComponentOverlap &overlap);
+	void OverlapComponents(ComponentTable &mainComponents, RunLengthMask &sideMask, ComponentOverlap &overlap);
+	void FillOverlap(std::unordered_map<uint64, uint32> &counts, int mainCount, ComponentOverlap &overlap);
+	bool ComponentInsideComponent(ComponentOverlap &overlap, int outsideLabel, ComponentTable &insideComponents, int insideLabel);
+	bool ComponentsIntersect(ComponentOverlap &overlap, int mainLabel, int sideLabel);
+	bool ComponentCenteredInsideComponent(ComponentTable &mainComponents, int mainLabel, ComponentTable &insideComponents, int insideLabel, int deltaError);
+	void RemoveSmallComponents(ComponentTable &components, unsigned char *data, int size);
+	void RemoveSmallComponents(RunLengthMask &mask, int size);
 
 	void RemoveWires(unsigned char *data);
-	void FillHoles(unsigned char *data, std::vector<Component> &components, std::vector<Component> &holes);
-	void FilterComponents(unsigned char *data, std::vector<Component> &components, int fitlerIntensity);
-	bool SolderingIslandCorrect(Component &component);
+	void FillHoles(unsigned char *data, ComponentTable &components, std::vector<int> &holes);
+	void FilterComponents(unsigned char *data, ComponentTable &components, int fitlerIntensity);
+	void FilterComponents(unsigned char *data, int filterIntensity);
+	bool SolderingIslandCorrect(ComponentTable &components, int label);
 	bool LiquidFilled();
 
 	void SetDataToView(unsigned char *data, int channels);
+	void RunInParallel(unsigned long jobs, const std::function<void(unsigned long)> &job);
+	unsigned long getBandCount(uint32 rows);
+	void RunInBands(uint32 rows, const std::function<void(unsigned long band, uint32 firstRow, uint32 lastRow)> &job);
 };
 
 class Interval
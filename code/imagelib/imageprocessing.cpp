@@ -8,94 +8,63 @@ void Image::FISHSignalCounts(FISHStage stage)
     _channels = 1;
 
     // DAPI cells
-    int *DAPIlabels = new int[getImageSize()];
-    std::vector<Component> DAPIcomponents;
-
-    Treshold(_blueData, 20);
-    Erosion(_blueData, 5, 5);
-    Dilation(_blueData, 5);
-    CCL(_blueData, DAPIlabels, DAPIcomponents);
-    FillHoles(_blueData, DAPIlabels, 0); // Background is component 0
-    CCL(_blueData, DAPIlabels, DAPIcomponents);
+    BitMask DAPIcells;
+    RunLengthMask DAPImask;
+    ComponentTable DAPIcomponents;
+
+    Treshold(_blueData, 20, DAPIcells);
+    Opening(DAPIcells, 5);
+    DAPIcells.toData(_blueData, MIN_INTENSITY, MAX_INTENSITY);
+    FillHoles(_blueData);
+
+    // Touching nuclei are split along the watershed of their distance transform
+    SplitComponents(_blueData, NUCLEI_SPLIT_DEPTH);
+    Treshold(_blueData, MIN_INTENSITY, DAPImask);
+    CCL(DAPImask, DAPIcomponents);
     cout << "DAPI cells found:" << DAPIcomponents.size() - 1 << std::endl; // Subtract background
 
     //Acredine mutations
-    int *ACRElabels = new int[getImageSize()];
-    std::vector<Component> ACREcomponents;
-    Treshold(_redData, 130);
-    //SetViewToSingleColor(Color::Red);
-    CCL(_redData, ACRElabels, ACREcomponents);
+    RunLengthMask ACREmask;
+    ComponentTable ACREcomponents;
+    Treshold(_redData, 130, ACREmask);
+    CCL(ACREmask, ACREcomponents);
     cout << "Acredine mutations found:" << ACREcomponents.size() - 1 << std::endl; // Subtract background
 
     //FITC mutations
-    int *FITClabels = new int[getImageSize()];
-    std::vector<Component> FITCcomponents;
-    Treshold(_greenData, 30);
-    //SetViewToSingleColor(Color::Green);
-    //return;
-    CCL(_greenData, FITClabels, FITCcomponents);
+    RunLengthMask FITCmask;
+    ComponentTable FITCcomponents;
+    Treshold(_greenData, 30, FITCmask);
+    CCL(FITCmask, FITCcomponents);
     cout << "FITC mutations found:" << FITCcomponents.size() - 1 << std::endl; // Subtract background
 
     int totalARCRused = 0;
     int totalFITCused = 0;
 
-    for (Component cell : DAPIcomponents)
-    {
-        if (cell.Label == 0)
-        {
-            continue; // Skip background
-        }
-
-        int ACRECount = 0;
-        int FITCCount = 0;
-        // count Acredine in cell
-        for (Component ACREmutation : ACREcomponents)
-        {
-            if (ACREmutation.Label == 0)
-            {
-                continue; // Skip background
-            }
+    // Cell x mutation overlaps for the whole frame, masks only pair foreground labels
+    ComponentOverlap ACREoverlap;
+    ComponentOverlap FITCoverlap;
+    OverlapComponents(DAPImask, ACREmask, ACREoverlap);
+    OverlapComponents(DAPImask, FITCmask, FITCoverlap);
 
-            // for (uint32 pixel : ACREmutation.Pixels)
-            // {
-            //     _blueData[pixel] = HIGHLIGHT_INTENSITY;
-            // }
-
-            if (ComponentsIntersect(cell, ACREmutation))
-            {
-                ACRECount++;
-                totalARCRused++;
-            }
-        }
-        // count FITC in cell
-        for (Component FITCmutation : FITCcomponents)
+    // Label 0 is the background in every table
+    for (int cell = 1; cell < DAPIcomponents.size(); cell++)
+    {
+        // count mutations in cell
+        int ACRECount = ACREoverlap.Overlaps[cell].size();
+        int FITCCount = FITCoverlap.Overlaps[cell].size();
+        totalARCRused += ACRECount;
+        totalFITCused += FITCCount;
+        if (cell == 3)
         {
-            if (FITCmutation.Label == 0)
-            {
-                continue; // Skip background
-            }
-
-            if (ComponentsIntersect(cell, FITCmutation))
+            for (auto &FITCmutation : FITCoverlap.Overlaps[cell])
             {
-                FITCCount++;
-                totalFITCused++;
-                if (cell.Label == 3)
-                {
-                    // cout << "ACRE: " << ACREmutation.Label << endl;
-                    // cout << "PIXELS: ";
-                    for (uint32 pixel : FITCmutation.Pixels)
-                    {
-                        //cout << pixel << " ";
-                        _blueData[pixel] = HIGHLIGHT_INTENSITY;
-                    }
-                    //cout << endl;
-                }
+                PaintComponent(_blueData, FITCmask, FITCmutation.first, HIGHLIGHT_INTENSITY);
             }
         }
 
         std::string ratio;
         ratio = FITCCount == 0 ? "N/A" : std::to_string((float)ACRECount / (float)FITCCount);
-        cout << "Cell " << cell.Label << " Acredine mutations: " << ACRECount << "FITC mutations: " << FITCCount << " Ratio: " << ratio << endl;
+        cout << "Cell " << cell << " Acredine mutations: " << ACRECount << "FITC mutations: " << FITCCount << " Ratio: " << ratio << endl;
     }
 
 
@@ -108,71 +77,59 @@ void Image::FISHSignalCounts(FISHStage stage)
 void Image::CircuitBoard(CircuitBoardStage stage)
 {
     RemoveSaltandPepper();
-    int *labels = new int[getImageSize()];
-    std::vector<Component> components;
+    ComponentTable components;
     cout << "Intensity:" << (int)_data[getImageSize() / 2 - 110] << endl;
 
     unsigned char *otherComponentsData = new unsigned char[getImageSize()];
     CopyData(_data, otherComponentsData, getImageSize());
-    CCL(otherComponentsData, labels, components);
-    FilterComponents(otherComponentsData, components, 96);
+    FilterComponents(otherComponentsData, 96);
     Dilation(otherComponentsData, 3);
-    CCL(otherComponentsData, labels, components);
-    std::vector<Component> otherComponents = components;
+    CCL(otherComponentsData, components);
+    ComponentTable otherComponents = components;
 
-    CCL(_data, labels, components);
+    CCL(_data, components);
 
-    cout << "background intensity " << (int)_data[components[0].Pixels[0]] << endl;
-    cout << "wire intensity " << (int)_data[components[1].Pixels[0]] << endl;
+    cout << "background intensity " << (int)components.Intensity[0] << endl;
+    cout << "wire intensity " << (int)components.Intensity[1] << endl;
 
     //Filter wires
-    FilterComponents(_data, components, WIRE_INTENSITY);
-    CCL(_data, labels, components);
+    FilterComponents(_data, WIRE_INTENSITY);
+    CCL(_data, components);
 
     // Remember holes and fill
-    std::vector<Component> solderingIslandHoles;
+    std::vector<int> solderingIslandHoles;
     FillHoles(_data, components, solderingIslandHoles);
-    CCL(_data, labels, components);
+    ComponentTable holes = components;
+    CCL(_data, components);
 
-    std::vector<Component> wires = components;
+    ComponentTable wires = components;
     cout << "components: " << components.size() << endl;
 
     RemoveWires(_data);
-    // We can try erosion and dilation but components loses form
-    // Erosion(_data, 1, 5);
-    // Erosion(_data, 5, 1);
-    // Dilation(_data, 5);
-    CCL(_data, labels, components);
+    CCL(_data, components);
     updateHistogram();
 
-    std::vector<Component> badWires;
+    std::vector<int> badWires;
+    ComponentOverlap wireComponents;
+    ComponentOverlap wireOtherComponents;
+    OverlapComponents(wires, components, wireComponents);
+    OverlapComponents(wires, otherComponents, wireOtherComponents);
 
-    for (Component wire : wires)
+    for (int wire = 1; wire < wires.size(); wire++)
     {
-        if (wire.Label == 0)
-            continue;
+        // Every non background label overlapping the wire is connected to it
         int elementsConnected = 0;
-        for (Component component : components)
+        for (auto &component : wireComponents.Overlaps[wire])
         {
-            if (component.Label == 0)
-                continue;
-
-            if (ComponentsIntersect(wire, component))
-            {
+            if (component.first != 0)
                 elementsConnected++;
-            }
         }
-        for (Component otherComponent : otherComponents)
+        for (auto &otherComponent : wireOtherComponents.Overlaps[wire])
         {
-            if (otherComponent.Label == 0)
-                continue;
-
-            if (ComponentsIntersect(wire, otherComponent))
-            {
+            if (otherComponent.first != 0)
                 elementsConnected++;
-            }
         }
-        cout << "components connected to wire " << wire.Label << ": " << elementsConnected << endl;
+        cout << "components connected to wire " << wire << ": " << elementsConnected << endl;
         if (elementsConnected < 2)
         {
             badWires.push_back(wire);
@@ -180,64 +137,49 @@ void Image::CircuitBoard(CircuitBoardStage stage)
     }
 
     // Remove connectors
-    for (Component component : components)
+    for (uint32 index = 0; index < _width * _height; index++)
     {
-        if (component.Label == 0)
+        int label = components.Labels[index];
+        if (label == 0)
             continue;
-        int intensity = component.Pixels.size() < SOLDERING_ISLAND_DELTA ? MIN_INTENSITY : MAX_INTENSITY;
-
-        for (uint32 pixel : component.Pixels)
-        {
-            _data[pixel] = intensity;
-        }
+        _data[index] = components.Area[label] < SOLDERING_ISLAND_DELTA ? MIN_INTENSITY : MAX_INTENSITY;
     }
-    CCL(_data, labels, components);
+    CCL(_data, components);
+    ComponentOverlap componentHoles;
+    OverlapComponents(components, holes, componentHoles);
 
     // Check if holes in correct places
-    for (Component component : components)
+    for (int component = 1; component < components.size(); component++)
     {
-        if (component.Label == 0)
-            continue;
         bool foundHole = false;
-        for (Component hole : solderingIslandHoles)
+        for (int hole : solderingIslandHoles)
         {
-            if (hole.Label == 0)
-                continue;
             // Also checking if hole is fully inside soldeing island!
-            if (ComponentInsideComponent(component, hole) == true)
+            if (ComponentInsideComponent(componentHoles, component, holes, hole) == true)
             {
                 foundHole = true;
                 // Check if centered
-                if (ComponentCenteredInsideComponent(component, hole, 1) == false)
+                if (ComponentCenteredInsideComponent(components, component, holes, hole, 1) == false)
                 {
-                    cout << "Component " << component.Label << " hole is not centered!" << endl;
-                    for (uint32 pixel : hole.Pixels)
-                    {
-                        _data[pixel] = HIGHLIGHT_INTENSITY;
-                    }
+                    cout << "Component " << component << " hole is not centered!" << endl;
+                    PaintComponent(_data, holes, hole, HIGHLIGHT_INTENSITY);
                 }
             }
         }
 
         if (foundHole == false)
         {
-            std::cout << "Could not found a hole for component " << component.Label << endl;
+            std::cout << "Could not found a hole for component " << component << endl;
         }
     }
 
     // Check for incorrect soldering islands
     int incorrectComponents = 0;
-    for (Component component : components)
+    for (int component = 1; component < components.size(); component++)
     {
-        if (component.Label == 0)
-            continue; // Skip background
-
-        if (SolderingIslandCorrect(component) == false)
+        if (SolderingIslandCorrect(components, component) == false)
         {
-            for (uint32 pixel : component.Pixels)
-            {
-                _data[pixel] = HIGHLIGHT_INTENSITY;
-            }
+            PaintComponent(_data, components, component, HIGHLIGHT_INTENSITY);
             incorrectComponents++;
         }
     }
@@ -245,12 +187,9 @@ void Image::CircuitBoard(CircuitBoardStage stage)
     cout << "Incorect components: " << incorrectComponents << endl;
 
     // Show bad wires
-    for (Component badWire : badWires)
+    for (int badWire : badWires)
     {
-        for (uint32 pixel : badWire.Pixels)
-        {
-            _data[pixel] = HIGHLIGHT_INTENSITY;
-        }
+        PaintComponent(_data, wires, badWire, HIGHLIGHT_INTENSITY);
     }
 
     updateHistogram();
@@ -258,89 +197,70 @@ void Image::CircuitBoard(CircuitBoardStage stage)
 
 void Image::Bottles(BottlesStage stage)
 {
-    int *labels = new int[getImageSize()];
-    std::vector<Component> components;
+    ComponentTable components;
 
     unsigned char *liquidData = new unsigned char[getImageSize()];
     CopyData(_data, liquidData, getImageSize());
 
     TresholdReverse(liquidData, 190);
 
-    Treshold(liquidData, 20);
-    CCL(liquidData, labels, components);
-
-    RemoveSmallComponents(components, liquidData, 10);
+    RunLengthMask liquidMask;
+    Treshold(liquidData, 20, liquidMask);
+    RemoveSmallComponents(liquidMask, 10);
 
-    Erosion(liquidData, 3, 3);
-    Dilation(liquidData, 3);
+    StructuringElement square(3, 3);
+    liquidMask.toData(liquidData, MIN_INTENSITY, MAX_INTENSITY);
+    Morphology(liquidData, square, MorphologyOpening);
+    Treshold(liquidData, MIN_INTENSITY, liquidMask);
 
-    CCL(liquidData, labels, components);
-    
-    std::vector<Component> liquids = components;
-    std::vector<Component> holes;
+    RemoveSmallComponents(liquidMask, 10);
+    FillHoles(liquidMask);
 
-    RemoveSmallComponents(liquids, liquidData, 50);
-    FillHoles(liquidData, liquids, holes);
-    
-    CCL(liquidData, labels, liquids);
+    ComponentTable liquids;
+    CCL(liquidMask, liquids);
 
     cout << "liquids " << liquids.size()<<endl;
 
     if (stage == LiquidSegmentation)
     {
-        liquids.shrink_to_fit();
         cout << "Liquid components: " << liquids.size() - 1 << endl;
-        CopyData(liquidData, _data, getImageSize());
+        liquidMask.toData(_data, MIN_INTENSITY, MAX_INTENSITY);
         updateHistogram();
         return;
     }
 
     Treshold(_data, 20);
-    CCL(_data, labels, components);
-    FillHoles(_data, components, holes);
-    CCL(_data, labels, components);
+    FillHoles(_data);
+    CCL(_data, components);
     cout << "Bottles found: " << components.size() << endl;
     
+    ComponentOverlap bottleLiquids;
+    OverlapComponents(components, liquidMask, bottleLiquids);
+
     int liquidLimit = (BOTTLENECK_START + BOTTLENECK_END) / 2;
-    for (Component bottle : components)
+    for (int bottle = 1; bottle < components.size(); bottle++)
     {
-        if (bottle.Label == 0)
-            continue; // Skip background
-
         bool liquidFound = false;
-        for (Component liquid : liquids)
+        for (int liquid = 1; liquid < liquids.size(); liquid++)
         {
-            //cout << "label" << liquid.Label << endl;
-            if (liquid.Label == 0)
-                continue; // Skip background
-
-            if (ComponentsIntersect(bottle, liquid))
+            //cout << "label" << liquid << endl;
+            if (ComponentsIntersect(bottleLiquids, bottle, liquid))
             {
-                for (uint32 pixel : liquid.Pixels)
-                {
-                    _data[pixel] = HIGHLIGHT_INTENSITY;
-                }
+                PaintComponent(_data, liquidMask, liquid, HIGHLIGHT_INTENSITY);
 
                 // Check if liquid is filled
-                int minX, minY, maxX, maxY, halfX;
-                GetComponentBoundaries(liquid, minX, maxX, minY, maxY);
+                int minY = liquids.MinY[liquid];
                 if (minY > liquidLimit + LIQUID_ERROR_BOTTOM)
                 {
                     // Bottle not filled
-                    cout << "Bottle " << bottle.Label << " not filled" << endl;
-                    for (uint32 pixel : liquid.Pixels)
-                    {
-                        _data[pixel] = 200;
-                    }
+                    cout << "Bottle " << bottle << " not filled" << endl;
+                    PaintComponent(_data, liquidMask, liquid, 200);
                 }
                 else if (minY < liquidLimit - LIQUID_ERROR_TOP)
                 {
                     // Bottle is overfilled
-                    cout << "Bottle " << bottle.Label << " overfilled" << endl;
-                    for (uint32 pixel : liquid.Pixels)
-                    {
-                        _data[pixel] = 50;
-                    }
+                    cout << "Bottle " << bottle << " overfilled" << endl;
+                    PaintComponent(_data, liquidMask, liquid, 50);
                 }
                 liquidFound = true;
                 break;
@@ -348,7 +268,7 @@ void Image::Bottles(BottlesStage stage)
         }
         if (liquidFound == false)
         {
-            cout << "Could not found liquid for bottle " << bottle.Label << endl;
+            cout << "Could not found liquid for bottle " << bottle << endl;
         }
     }
 
@@ -405,19 +325,22 @@ void Image::RemoveWires(unsigned char *data)
         }
 }
 
-void Image::FillHoles(unsigned char *data, std::vector<Component> &components, std::vector<Component> &holes)
+void Image::FillHoles(unsigned char *data, ComponentTable &components, std::vector<int> &holes)
 {
-    for (Component component : components)
+    for (int label = 1; label < components.size(); label++)
     {
-        if (component.Label == 0)
-            continue;
-        if (component.Intensity == MIN_INTENSITY)
+        if (components.Intensity[label] == MIN_INTENSITY)
         {
-            holes.push_back(component);
-            for (uint32 pixel : component.Pixels)
-            {
-                data[pixel] = MAX_INTENSITY;
-            }
+            holes.push_back(label);
         }
     }
-}
+
+    for (uint32 index = 0; index < _width * _height; index++)
+    {
+        int label = components.Labels[index];
+        if (label != 0 && components.Intensity[label] == MIN_INTENSITY)
+        {
+            data[index] = MAX_INTENSITY;
+        }
+    }
+}
\ No newline at end of file
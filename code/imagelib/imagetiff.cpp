@@ -1,9 +1,13 @@
 #include "image.hpp"
 
-bool Image::readTiffMetaData(TIFF *tiff)
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+bool Image::readTiffMetaData(TIFF *tiff, tdir_t directory)
 {
-  std::cout << "Test";
-  TIFFSetDirectory(tiff, 0); // NB!
+  TIFFSetDirectory(tiff, directory); // NB!
   // Read using TIFFGetField
   TIFFGetField(tiff, TIFFTAG_IMAGEWIDTH, &_width);
   TIFFGetField(tiff, TIFFTAG_IMAGELENGTH, &_height);
@@ -13,95 +17,354 @@ bool Image::readTiffMetaData(TIFF *tiff)
   return true;
 }
 
+// The image keeps one byte per sample with the samples of a pixel side by
+// side, tiffs stored otherwise are not decoded
+bool Image::checkTiffLayout(TIFF *tiff)
+{
+  uint16 planar = PLANARCONFIG_CONTIG;
+  TIFFGetFieldDefaulted(tiff, TIFFTAG_PLANARCONFIG, &planar);
+  if (_bps != 8 || (planar != PLANARCONFIG_CONTIG && _channels > 1))
+  {
+    std::cout << "Only 8 bit interleaved tiffs are supported" << std::endl;
+    return false;
+  }
+  return true;
+}
+
+// Runs read(handle, job, chunk) for every tile or strip on the worker
+// threads. Each worker gets its own handle on the file and directory, so
+// decompression runs in parallel. Without a file name to reopen, workers
+// take turns on the shared handle.
+bool Image::readTiffChunks(TIFF *tiff, uint32 chunks, const std::function<bool(TIFF *handle, unsigned long job, uint32 chunk)> &read)
+{
+  tdir_t directory = TIFFCurrentDirectory(tiff);
+  std::atomic<uint32> nextChunk(0);
+  std::atomic<bool> ok(true);
+  std::mutex sharedLock;
+  unsigned long jobs = std::max<unsigned long>(1, std::min<unsigned long>(getThreadCount(), chunks));
+
+  RunInParallel(jobs, [&](unsigned long job) {
+    TIFF *handle = jobs > 1 ? TIFFOpen(TIFFFileName(tiff), "r") : nullptr;
+    if (handle != nullptr)
+    {
+      TIFFSetDirectory(handle, directory);
+    }
+    for (uint32 chunk = nextChunk++; chunk < chunks; chunk = nextChunk++)
+    {
+      if (handle != nullptr)
+      {
+        if (!read(handle, job, chunk))
+          ok = false;
+        continue;
+      }
+      std::lock_guard<std::mutex> guard(sharedLock);
+      if (!read(tiff, job, chunk))
+        ok = false;
+    }
+    if (handle != nullptr)
+    {
+      TIFFClose(handle);
+    }
+  });
+  return ok;
+}
+
 bool Image::loadTiffTiled(TIFF *tiff)
 {
   std::cout << "Tiff is tiled" << std::endl;
   // Get tile info
-  unsigned long tileWidth{0};
-  unsigned long tileHeight{0};
+  uint32 tileWidth{0};
+  uint32 tileHeight{0};
   TIFFGetField(tiff, TIFFTAG_TILEWIDTH, &tileWidth);
   TIFFGetField(tiff, TIFFTAG_TILELENGTH, &tileHeight);
 
   std::cout << "Tile Width: " << tileWidth << std::endl;
   std::cout << "Tile Height: " << tileHeight << std::endl;
+  if (!checkTiffLayout(tiff))
+    return false;
 
   // Aloc image
-  _data = (unsigned char *)_TIFFmalloc(getImageSize());
-
-  // Aloc tile
-  unsigned char *buffer = (unsigned char *)_TIFFmalloc(tileWidth * tileHeight * _channels);
-
-  // Iterate tiles
-  for (unsigned long y = 0; y < _height; y += tileHeight)
-  {
-    for (unsigned long x = 0; x < _width; x += tileWidth)
+  _data = new unsigned char[getImageSize()];
+
+  // One tile buffer per worker
+  uint32 pixelSize = _channels;
+  uint32 tileColumns = (_width + tileWidth - 1) / tileWidth;
+  uint32 tiles = TIFFNumberOfTiles(tiff);
+  std::vector<std::vector<unsigned char>> buffers(getThreadCount(), std::vector<unsigned char>(TIFFTileSize(tiff)));
+
+  bool ok = readTiffChunks(tiff, tiles, [&](TIFF *handle, unsigned long job, uint32 tile) {
+    unsigned char *buffer = buffers[job].data();
+    if (TIFFReadEncodedTile(handle, tile, buffer, buffers[job].size()) < 0)
+      return false;
+
+    // Edge tiles reach past the image, only their inside is copied
+    uint32 x = tile % tileColumns * tileWidth;
+    uint32 y = tile / tileColumns * tileHeight;
+    uint32 width = std::min<uint32>(tileWidth, _width - x);
+    uint32 height = std::min<uint32>(tileHeight, _height - y);
+    for (uint32 row = 0; row < height; row++)
     {
-      TIFFReadTile(tiff, buffer, x, y, 0, 0);
-
-      for (unsigned int ty = 0; ty < tileHeight; ty++)
-      {
-        for (unsigned long tx = 0; tx < tileWidth; tx++)
-        {
-          if (((x + tx) < _width) && ((y + ty) < _height))
-          {
-            unsigned long dest = ((y + ty) * _width + (x + tx)) * _channels;
-            unsigned long source = (ty * tileWidth + tx) * _channels;
-
-            _data[dest] = buffer[source];
-            _data[dest + 1] = buffer[source + 1];
-            _data[dest + 2] = buffer[source + 2];
-          }
-        }
-      }
+      memcpy(_data + ((size_t)(y + row) * _width + x) * pixelSize, buffer + (size_t)row * tileWidth * pixelSize, (size_t)width * pixelSize);
     }
-  }
-  _TIFFfree(buffer);
+    return true;
+  });
   std::cout << "Finished reading" << std::endl;
-  return true;
+  return ok;
 }
 
-bool Image::loadTiffScanline(TIFF *tiff)
+bool Image::loadTiffStrip(TIFF *tiff)
 {
   std::cout << "Tiff is striped" << std::endl;
+  uint32 rowsPerStrip = _height;
+  TIFFGetFieldDefaulted(tiff, TIFFTAG_ROWSPERSTRIP, &rowsPerStrip);
+  rowsPerStrip = std::min<uint32>(rowsPerStrip, _height);
   tmsize_t lineSize = TIFFScanlineSize(tiff);
+  // Strip numbers of separate planes count every plane
+  if (!checkTiffLayout(tiff))
+    return false;
 
   // Aloc image
-  _data = (unsigned char *)_TIFFmalloc(getImageSize());
+  _data = new unsigned char[getImageSize()];
+
+  // Strips decode straight into their rows of the image
+  bool ok = readTiffChunks(tiff, TIFFNumberOfStrips(tiff), [&](TIFF *handle, unsigned long, uint32 strip) {
+    uint32 firstRow = strip * rowsPerStrip;
+    uint32 rows = std::min<uint32>(rowsPerStrip, _height - firstRow);
+    return TIFFReadEncodedStrip(handle, strip, _data + firstRow * lineSize, rows * lineSize) >= 0;
+  });
+  std::cout << "Finished reading" << std::endl;
+  return ok;
+}
 
-  // Aloc buffer
-  unsigned char *buf = (unsigned char *)_TIFFmalloc(lineSize);
+// Points _data straight into a private mapping of the file when the pixels
+// are stored as they are laid out in memory: uncompressed 8 bit samples,
+// interleaved, in strips that follow each other without gaps
+bool Image::mapTiff(std::string filename, TIFF *tiff)
+{
+  uint16 compression = COMPRESSION_NONE;
+  uint16 planar = PLANARCONFIG_CONTIG;
+  TIFFGetFieldDefaulted(tiff, TIFFTAG_COMPRESSION, &compression);
+  TIFFGetFieldDefaulted(tiff, TIFFTAG_PLANARCONFIG, &planar);
+  if (TIFFIsTiled(tiff) || compression != COMPRESSION_NONE || _bps != 8 || (planar != PLANARCONFIG_CONTIG && _channels > 1))
+    return false;
+
+  uint32 rowsPerStrip = _height;
+  TIFFGetFieldDefaulted(tiff, TIFFTAG_ROWSPERSTRIP, &rowsPerStrip);
+  toff_t *offsets = nullptr;
+  if (!TIFFGetField(tiff, TIFFTAG_STRIPOFFSETS, &offsets))
+    return false;
+  uint64 lineSize = _width * _channels;
+  for (uint32 strip = 1; strip < TIFFNumberOfStrips(tiff); strip++)
+  {
+    if (offsets[strip] != offsets[0] + strip * rowsPerStrip * lineSize)
+      return false;
+  }
 
-  for (unsigned int row = 0; row < _height; row++)
+  int file = open(filename.c_str(), O_RDONLY);
+  if (file < 0)
+    return false;
+  struct stat status;
+  if (fstat(file, &status) != 0 || offsets[0] + _height * lineSize > (uint64)status.st_size)
   {
-    tmsize_t offset = lineSize * row;
-    TIFFReadScanline(tiff, buf, row, 0);
-    for (size_t x = 0; x < lineSize; x++)
-    {
-      _data[offset + x] = buf[x];
-    }
+    close(file);
+    return false;
   }
-  std::cout << "Finished reading" << std::endl;
+  // Writes copy the page they touch, the file is never changed
+  void *mapping = mmap(nullptr, status.st_size, PROT_READ | PROT_WRITE, MAP_PRIVATE, file, 0);
+  close(file);
+  if (mapping == MAP_FAILED)
+    return false;
+
+  std::cout << "Tiff is mapped" << std::endl;
+  _mapping = mapping;
+  _mappingSize = status.st_size;
+  _data = (unsigned char *)mapping + offsets[0];
+  return true;
+}
 
-  _TIFFfree(buf);
+// Region bounds are pixel indices of the file, inclusive like _region
+bool Image::loadTiffRegion(TiffTileCache &tiff, BBox region)
+{
+  if (!tiff.isOpen())
+    return false;
+  if (tiff.getBitsPerSample() != 8)
+  {
+    std::cout << "Only 8 bit interleaved tiffs are supported" << std::endl;
+    return false;
+  }
+
+  _region = region;
+  _width = (unsigned long)(region.max_x - region.min_x) + 1;
+  _height = (unsigned long)(region.max_y - region.min_y) + 1;
+  _channels = tiff.getChannels();
+  _bps = tiff.getBitsPerSample();
+  _data = new unsigned char[getImageSize()];
+  if (!tiff.readRegion((int)region.min_x, (int)region.min_y, _width, _height, _data))
+  {
+    // Left empty, as when opening the whole file fails
+    releaseData();
+    _width = 0;
+    _height = 0;
+    return false;
+  }
   return true;
 }
 
-bool Image::loadTiff(std::string filename)
+std::vector<TiffLevel> Image::getTiffLevels(std::string filename)
+{
+  std::vector<TiffLevel> levels;
+  TIFF *tiff = TIFFOpen(filename.c_str(), "r");
+  if (tiff != nullptr)
+  {
+    levels = getTiffLevels(tiff);
+    TIFFClose(tiff);
+  }
+  return levels;
+}
+
+// Scanners store the reduced resolutions as further directories, flagged
+// as reduced images and usually but not always written largest first
+std::vector<TiffLevel> Image::getTiffLevels(TIFF *tiff)
+{
+  std::vector<TiffLevel> levels;
+  tdir_t current = TIFFCurrentDirectory(tiff);
+  TIFFSetDirectory(tiff, 0);
+  do
+  {
+    uint32 subfileType = 0;
+    TIFFGetFieldDefaulted(tiff, TIFFTAG_SUBFILETYPE, &subfileType);
+    if (subfileType & FILETYPE_MASK)
+      continue;
+    uint32 width = 0;
+    uint32 height = 0;
+    TIFFGetField(tiff, TIFFTAG_IMAGEWIDTH, &width);
+    TIFFGetField(tiff, TIFFTAG_IMAGELENGTH, &height);
+    levels.push_back(TiffLevel(TIFFCurrentDirectory(tiff), width, height));
+  } while (TIFFReadDirectory(tiff));
+  TIFFSetDirectory(tiff, current);
+
+  std::stable_sort(levels.begin(), levels.end(), [](const TiffLevel &a, const TiffLevel &b) {
+    return (uint64)a.Width * a.Height > (uint64)b.Width * b.Height;
+  });
+  return levels;
+}
+
+bool Image::loadTiff(std::string filename, uint16 level, bool mapped)
 {
   std::cout << "Loading tif: " << filename << std::endl;
 
   TIFF *tiff = TIFFOpen(filename.c_str(), "r");
-  // Read image meta data, height, width etc.
+  if (tiff == nullptr)
+    return false;
 
-  this->readTiffMetaData(tiff);
+  std::vector<TiffLevel> levels = getTiffLevels(tiff);
+  if (level >= levels.size())
+  {
+    std::cout << "No level " << level << " in " << filename << std::endl;
+    TIFFClose(tiff);
+    return false;
+  }
+
+  // Read image meta data, height, width etc.
+  this->readTiffMetaData(tiff, levels[level].Directory);
 
-  if (TIFFIsTiled(tiff))
-    return loadTiffTiled(tiff);
+  bool ok;
+  if (mapped && mapTiff(filename, tiff))
+    ok = true;
+  else if (TIFFIsTiled(tiff))
+    ok = loadTiffTiled(tiff);
   else
-    return loadTiffScanline(tiff);
-  return true;
+    ok = loadTiffStrip(tiff);
+  TIFFClose(tiff);
+  return ok;
 };
 
+// Averages 2 x 2 blocks, odd edges average the pixels they have
+static void HalveLevel(unsigned char *data, uint32 width, uint32 height, uint32 channels, unsigned char *half)
+{
+  uint32 halfWidth = (width + 1) / 2;
+  uint32 halfHeight = (height + 1) / 2;
+  for (uint32 y = 0; y < halfHeight; y++)
+    for (uint32 x = 0; x < halfWidth; x++)
+    {
+      uint32 lastX = std::min(2 * x + 2, width);
+      uint32 lastY = std::min(2 * y + 2, height);
+      uint32 count = (lastX - 2 * x) * (lastY - 2 * y);
+      for (uint32 c = 0; c < channels; c++)
+      {
+        uint32 sum = 0;
+        for (uint32 sy = 2 * y; sy < lastY; sy++)
+          for (uint32 sx = 2 * x; sx < lastX; sx++)
+          {
+            sum += data[((size_t)sy * width + sx) * channels + c];
+          }
+        half[((size_t)y * halfWidth + x) * channels + c] = (sum + count / 2) / count;
+      }
+    }
+}
+
+bool Image::saveTiff(std::string filename, bool pyramid)
+{
+  TIFF *tiff = TIFFOpen(filename.c_str(), "w");
+  if (tiff == nullptr)
+  {
+    std::cout << "Could not create " << filename << std::endl;
+    return false;
+  }
+
+  bool ok = writeTiffLevel(tiff, _data, _width, _height, false);
+  uint32 width = _width;
+  uint32 height = _height;
+  std::vector<unsigned char> level;
+  std::vector<unsigned char> half;
+  unsigned char *data = _data;
+  while (ok && pyramid && (width > (uint32)PYRAMID_TILE_SIZE || height > (uint32)PYRAMID_TILE_SIZE))
+  {
+    half.resize((size_t)((width + 1) / 2) * ((height + 1) / 2) * _channels);
+    HalveLevel(data, width, height, _channels, half.data());
+    level.swap(half);
+    data = level.data();
+    width = (width + 1) / 2;
+    height = (height + 1) / 2;
+    ok = writeTiffLevel(tiff, data, width, height, true);
+  }
+
+  TIFFClose(tiff);
+  return ok;
+}
+
+// Writes one directory of PYRAMID_TILE_SIZE tiles, LZW compressed
+bool Image::writeTiffLevel(TIFF *tiff, unsigned char *data, uint32 width, uint32 height, bool reduced)
+{
+  uint32 tileSize = PYRAMID_TILE_SIZE;
+  TIFFSetField(tiff, TIFFTAG_SUBFILETYPE, reduced ? FILETYPE_REDUCEDIMAGE : 0);
+  TIFFSetField(tiff, TIFFTAG_IMAGEWIDTH, width);
+  TIFFSetField(tiff, TIFFTAG_IMAGELENGTH, height);
+  TIFFSetField(tiff, TIFFTAG_BITSPERSAMPLE, 8);
+  TIFFSetField(tiff, TIFFTAG_SAMPLESPERPIXEL, _channels);
+  TIFFSetField(tiff, TIFFTAG_PHOTOMETRIC, _channels == 3 ? PHOTOMETRIC_RGB : PHOTOMETRIC_MINISBLACK);
+  TIFFSetField(tiff, TIFFTAG_PLANARCONFIG, PLANARCONFIG_CONTIG);
+  TIFFSetField(tiff, TIFFTAG_COMPRESSION, COMPRESSION_LZW);
+  TIFFSetField(tiff, TIFFTAG_TILEWIDTH, tileSize);
+  TIFFSetField(tiff, TIFFTAG_TILELENGTH, tileSize);
+
+  // Edge tiles are padded with zeros
+  std::vector<unsigned char> tile((size_t)tileSize * tileSize * _channels);
+  for (uint32 y = 0; y < height; y += tileSize)
+    for (uint32 x = 0; x < width; x += tileSize)
+    {
+      uint32 tileWidth = std::min(tileSize, width - x);
+      std::fill(tile.begin(), tile.end(), 0);
+      for (uint32 row = 0; row < std::min(tileSize, height - y); row++)
+      {
+        memcpy(tile.data() + (size_t)row * tileSize * _channels, data + ((size_t)(y + row) * width + x) * _channels, (size_t)tileWidth * _channels);
+      }
+      if (TIFFWriteTile(tiff, tile.data(), x, y, 0, 0) < 0)
+        return false;
+    }
+  return TIFFWriteDirectory(tiff) != 0;
+}
+
 bool Image::saveTiff()
 {
   std::cout << "Saving file newTiff.tif" << std::endl;
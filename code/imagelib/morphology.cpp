@@ -1,15 +1,263 @@
 #include "image.hpp"
+#include <queue>
 
 using std::cout;
 using std::endl;
 
+// van Herk/Gil-Werman min or max of line[x + from] up to line[x + to] for
+// every x, at constant cost per pixel whatever the window size. Values
+// outside the line are taken as pad.
+template <bool Maximum>
+static void MinMaxLine(const unsigned char *line, unsigned char *result, uint32 length, int from, int to, unsigned char pad, std::vector<unsigned char> &prefix, std::vector<unsigned char> &suffix)
+{
+    uint32 window = to - from + 1;
+    uint32 padded = length + window - 1;
+    prefix.assign(padded, pad);
+    suffix.assign(padded, pad);
+    // Padded position j holds line[j + from]
+    for (int j = std::max(0, -from); j < (int)padded && j + from < (int)length; j++)
+    {
+        prefix[j] = suffix[j] = line[j + from];
+    }
+
+    // Running min/max forward and backward inside blocks of one window
+    for (uint32 blockStart = 0; blockStart < padded; blockStart += window)
+    {
+        uint32 blockEnd = std::min(blockStart + window, padded);
+        for (uint32 i = blockStart + 1; i < blockEnd; i++)
+        {
+            prefix[i] = Maximum ? std::max(prefix[i], prefix[i - 1]) : std::min(prefix[i], prefix[i - 1]);
+        }
+        for (uint32 i = blockEnd - 1; i > blockStart; i--)
+        {
+            suffix[i - 1] = Maximum ? std::max(suffix[i - 1], suffix[i]) : std::min(suffix[i - 1], suffix[i]);
+        }
+    }
+
+    // Every window spans the end of one block and the start of the next
+    for (uint32 x = 0; x < length; x++)
+    {
+        result[x] = Maximum ? std::max(suffix[x], prefix[x + window - 1]) : std::min(suffix[x], prefix[x + window - 1]);
+    }
+}
+
+static void MinMaxLine(bool maximum, const unsigned char *line, unsigned char *result, uint32 length, int from, int to, unsigned char pad, std::vector<unsigned char> &prefix, std::vector<unsigned char> &suffix)
+{
+    if (maximum)
+        MinMaxLine<true>(line, result, length, from, to, pad, prefix, suffix);
+    else
+        MinMaxLine<false>(line, result, length, from, to, pad, prefix, suffix);
+}
+
+void Image::ApplyLine(unsigned char *data, uint32 width, uint32 height, LineStep &step, bool maximum, unsigned char pad)
+{
+    // Every image line along the step starts at a pixel whose predecessor is outside
+    std::vector<std::pair<int, int>> starts;
+    for (int y = 0; y < (int)height; y++)
+        for (int x = 0; x < (int)width; x++)
+        {
+            if (y > 0 && y < (int)height - 1 && x > 0 && x < (int)width - 1)
+                x = width - 1; // Only border pixels can start a line
+            int previousX = x - step.StepX;
+            int previousY = y - step.StepY;
+            if (previousX < 0 || previousY < 0 || previousX >= (int)width || previousY >= (int)height)
+                starts.push_back(std::make_pair(x, y));
+        }
+
+    unsigned int threads = getThreadCount();
+    RunInParallel(threads, [&](unsigned long job) {
+        std::vector<unsigned char> line, result, prefix, suffix;
+        for (uint32 start = job; start < starts.size(); start += threads)
+        {
+            line.clear();
+            for (int x = starts[start].first, y = starts[start].second; x >= 0 && y >= 0 && x < (int)width && y < (int)height; x += step.StepX, y += step.StepY)
+            {
+                line.push_back(data[y * width + x]);
+            }
+            result.resize(line.size());
+            MinMaxLine(maximum, line.data(), result.data(), line.size(), -step.Before, step.After, pad, prefix, suffix);
+
+            uint32 i = 0;
+            for (int x = starts[start].first, y = starts[start].second; x >= 0 && y >= 0 && x < (int)width && y < (int)height; x += step.StepX, y += step.StepY)
+            {
+                data[y * width + x] = result[i++];
+            }
+        }
+    });
+}
+
+void Image::ApplyElement(unsigned char *data, uint32 width, uint32 height, StructuringElement &element, bool maximum, unsigned char pad)
+{
+    // Line chains run as one directional pass per line
+    if (!element.Chain.empty())
+    {
+        for (LineStep &step : element.Chain)
+        {
+            ApplyLine(data, width, height, step, maximum, pad);
+        }
+        return;
+    }
+
+    // Otherwise every member run is a window over one source row. Rows are
+    // filtered in place, a ring keeps the original rows still in reach.
+    int reach = element.reach();
+    uint32 ringRows = 2 * reach + 1;
+    std::vector<unsigned char> ring(ringRows * width);
+    std::vector<unsigned char> output(width), window(width), prefix, suffix;
+    for (int y = 0; y < reach && y < (int)height; y++)
+    {
+        std::copy(data + y * width, data + (y + 1) * width, ring.begin() + (y % ringRows) * width);
+    }
+
+    for (int y = 0; y < (int)height; y++)
+    {
+        if (y + reach < (int)height)
+        {
+            std::copy(data + (y + reach) * width, data + (y + reach + 1) * width, ring.begin() + ((y + reach) % ringRows) * width);
+        }
+
+        std::fill(output.begin(), output.end(), maximum ? MIN_INTENSITY : MAX_INTENSITY);
+        for (ElementRun &run : element.Runs)
+        {
+            int sourceY = y + run.DY;
+            if (sourceY < 0 || sourceY >= (int)height)
+            {
+                std::fill(window.begin(), window.end(), pad);
+            }
+            else
+            {
+                MinMaxLine(maximum, ring.data() + (sourceY % ringRows) * width, window.data(), width, run.MinX, run.MaxX, pad, prefix, suffix);
+            }
+            for (uint32 x = 0; x < width; x++)
+            {
+                output[x] = maximum ? std::max(output[x], window[x]) : std::min(output[x], window[x]);
+            }
+        }
+        std::copy(output.begin(), output.end(), data + y * width);
+    }
+}
+
+void Image::MorphologyInBands(unsigned char *data, int margin, const std::function<void(unsigned char *, unsigned char *, uint32)> &operation)
+{
+    // Each band is processed on a copy including margin rows above and below,
+    // so no full size intermediate image is needed. Margin rows only absorb
+    // the effect of the band edges and are not written back.
+    const uint32 bandRows = 256;
+    std::vector<unsigned char> original, output, carry;
+    for (uint32 bandStart = 0; bandStart < _height; bandStart += bandRows)
+    {
+        uint32 bandEnd = std::min<uint32>(bandStart + bandRows, _height);
+        uint32 first = bandStart > (uint32)margin ? bandStart - margin : 0;
+        uint32 last = std::min<uint32>(bandEnd + margin, _height);
+        uint32 rows = last - first;
+
+        // Rows above the band were already overwritten, their originals are carried over
+        original.resize(rows * _width);
+        std::copy(carry.begin(), carry.end(), original.begin());
+        std::copy(data + bandStart * _width, data + last * _width, original.begin() + (bandStart - first) * _width);
+
+        uint32 carryFirst = std::max(first, bandEnd > (uint32)margin ? bandEnd - margin : 0);
+        carry.assign(original.begin() + (carryFirst - first) * _width, original.begin() + (bandEnd - first) * _width);
+
+        output.resize(rows * _width);
+        operation(original.data(), output.data(), rows);
+        std::copy(output.begin() + (bandStart - first) * _width, output.begin() + (bandEnd - first) * _width, data + bandStart * _width);
+    }
+}
+
+void Image::Erosion(unsigned char *data, StructuringElement &element)
+{
+    ApplyElement(data, _width, _height, element, false, MIN_INTENSITY);
+}
+
+void Image::Dilation(unsigned char *data, StructuringElement &element)
+{
+    ApplyElement(data, _width, _height, element, true, MIN_INTENSITY);
+}
+
+void Image::Morphology(unsigned char *data, StructuringElement &element, MorphologyOperator op)
+{
+    // Opening and closing chain two operations, so edge effects reach twice as far.
+    // Outside the image erosion sees MAX_INTENSITY here, so borders do not
+    // darken the result.
+    int reach = element.reach();
+    int margin = op == MorphologyGradient ? reach : 2 * reach;
+
+    MorphologyInBands(data, margin, [&](unsigned char *original, unsigned char *output, uint32 rows) {
+        uint32 size = rows * _width;
+        std::copy(original, original + size, output);
+        switch (op)
+        {
+        case MorphologyOpening:
+        case MorphologyTopHat:
+            ApplyElement(output, _width, rows, element, false, MAX_INTENSITY);
+            ApplyElement(output, _width, rows, element, true, MIN_INTENSITY);
+            break;
+        case MorphologyClosing:
+        case MorphologyBlackTopHat:
+            ApplyElement(output, _width, rows, element, true, MIN_INTENSITY);
+            ApplyElement(output, _width, rows, element, false, MAX_INTENSITY);
+            break;
+        case MorphologyGradient:
+        {
+            std::vector<unsigned char> eroded(original, original + size);
+            ApplyElement(output, _width, rows, element, true, MIN_INTENSITY);
+            ApplyElement(eroded.data(), _width, rows, element, false, MAX_INTENSITY);
+            // Elements without their origin can erode above the dilation
+            for (uint32 i = 0; i < size; i++)
+            {
+                output[i] = output[i] > eroded[i] ? output[i] - eroded[i] : 0;
+            }
+            break;
+        }
+        }
+
+        if (op == MorphologyTopHat)
+        {
+            for (uint32 i = 0; i < size; i++)
+            {
+                output[i] = original[i] > output[i] ? original[i] - output[i] : 0;
+            }
+        }
+        if (op == MorphologyBlackTopHat)
+        {
+            for (uint32 i = 0; i < size; i++)
+            {
+                output[i] = output[i] > original[i] ? output[i] - original[i] : 0;
+            }
+        }
+    });
+}
+
+void Image::HitOrMiss(unsigned char *data, StructuringElement &hit, StructuringElement &miss)
+{
+    // Foreground must contain hit and background must contain miss,
+    // everything outside the image counts as background
+    int margin = std::max(hit.reach(), miss.reach());
+
+    MorphologyInBands(data, margin, [&](unsigned char *original, unsigned char *output, uint32 rows) {
+        uint32 size = rows * _width;
+        std::vector<unsigned char> background(size);
+        for (uint32 i = 0; i < size; i++)
+        {
+            output[i] = original[i];
+            background[i] = MAX_INTENSITY - original[i];
+        }
+        ApplyElement(output, _width, rows, hit, false, MIN_INTENSITY);
+        ApplyElement(background.data(), _width, rows, miss, false, MAX_INTENSITY);
+        for (uint32 i = 0; i < size; i++)
+        {
+            output[i] = output[i] == MAX_INTENSITY && background[i] == MAX_INTENSITY ? MAX_INTENSITY : MIN_INTENSITY;
+        }
+    });
+}
+
+// Rectangular erosion as a min filter, so it also works on grayscale data.
+// Pixels outside the image count as MIN_INTENSITY.
 void Image::Erosion(unsigned char *data, int XWidth, int YWidth)
 {
-    unsigned char *tempData = new unsigned char[getImageSize()];
     int halfY = (YWidth - 1) / 2;
     int halfX = (XWidth - 1) / 2;
-    uint16 rectangleSize = XWidth * YWidth;
-    uint16 pixelCount = 0;
     if (XWidth % 2 == 0)
     {
         halfX = XWidth / 2;
@@ -18,68 +266,247 @@ void Image::Erosion(unsigned char *data, int XWidth, int YWidth)
     {
         halfY = YWidth / 2;
     }
-    std::cout << (XWidth - 1) << " " << halfY << " " << rectangleSize << std::endl;
 
-    for (int y = 0; y < _height; y++)
+    StructuringElement rectangle(2 * halfX + 1, 2 * halfY + 1);
+    Erosion(data, rectangle);
+}
+
+// Square dilation as a max filter, so it also works on grayscale data
+void Image::Dilation(unsigned char *data, int width)
+{
+    int halfSquare = (width - 1) / 2;
+
+    StructuringElement square(2 * halfSquare + 1, 2 * halfSquare + 1);
+    Dilation(data, square);
+}
+
+void Image::Erosion(RunLengthMask &mask, int XWidth, int YWidth)
+{
+    int halfY = YWidth % 2 == 0 ? YWidth / 2 : (YWidth - 1) / 2;
+    int halfX = XWidth % 2 == 0 ? XWidth / 2 : (XWidth - 1) / 2;
+
+    // Horizontal pass shrinks every run, windows reaching outside the image are eroded
+    RunLengthMask rows;
+    rows.reset(mask.Width, mask.Height);
+    for (uint32 y = 0; y < mask.Height; y++)
+    {
+        for (uint32 run = mask.Rows[y]; run < mask.Rows[y + 1]; run++)
+        {
+            if (mask.Runs[run].End - mask.Runs[run].Start > (uint32)(2 * halfX))
+                rows.Runs.push_back(MaskRun(mask.Runs[run].Start + halfX, mask.Runs[run].End - halfX));
+        }
+        rows.Rows.push_back(rows.Runs.size());
+    }
+
+    // Vertical pass keeps what is set in every row of the window
+    mask.reset(rows.Width, rows.Height);
+    std::vector<MaskRun> row;
+    std::vector<MaskRun> next;
+    for (int y = 0; y < (int)rows.Height; y++)
     {
-        for (int x = 0; x < _width; x++)
+        row.clear();
+        if (y - halfY >= 0 && y + halfY < (int)rows.Height)
         {
-            for (int y2 = -halfY; y2 <= halfY; y2++)
+            row.assign(rows.Runs.begin() + rows.Rows[y - halfY], rows.Runs.begin() + rows.Rows[y - halfY + 1]);
+            for (int y2 = y - halfY + 1; y2 <= y + halfY && !row.empty(); y2++)
             {
-                for (int x2 = -halfX; x2 <= halfX; x2++)
+                // Intersect two sorted run lists
+                next.clear();
+                uint32 other = rows.Rows[y2];
+                for (MaskRun &run : row)
                 {
-                    // Check if selected point is contained by the image
-                    int selectedX = x + x2;
-                    int selectedY = y + y2;
-                    if (selectedX >= 0 && selectedY >= 0 && selectedX < _width && selectedY < _height)
+                    while (other < rows.Rows[y2 + 1] && rows.Runs[other].End <= run.Start)
+                        other++;
+                    for (uint32 i = other; i < rows.Rows[y2 + 1] && rows.Runs[i].Start < run.End; i++)
                     {
-                        if (data[selectedY * _width + selectedX] == MAX_INTENSITY)
-                        {
-                            pixelCount++;
-                        }
+                        next.push_back(MaskRun(std::max(run.Start, rows.Runs[i].Start), std::min(run.End, rows.Runs[i].End)));
                     }
                 }
+                row.swap(next);
             }
-            tempData[y * _width + x] = rectangleSize <= pixelCount ? MAX_INTENSITY : MIN_INTENSITY;
-            pixelCount = 0;
         }
+        mask.appendRow(row);
+    }
+}
+
+void Image::Dilation(RunLengthMask &mask, int width)
+{
+    int halfSquare = (width - 1) / 2;
+
+    // Horizontal pass grows every run, clipped to the image
+    RunLengthMask rows;
+    rows.reset(mask.Width, mask.Height);
+    std::vector<MaskRun> row;
+    for (uint32 y = 0; y < mask.Height; y++)
+    {
+        row.clear();
+        for (uint32 run = mask.Rows[y]; run < mask.Rows[y + 1]; run++)
+        {
+            uint32 start = mask.Runs[run].Start > (uint32)halfSquare ? mask.Runs[run].Start - halfSquare : 0;
+            row.push_back(MaskRun(start, std::min(mask.Runs[run].End + halfSquare, mask.Width)));
+        }
+        rows.appendRow(row);
     }
 
-    for (uint32 i = 0; i < getImageSize(); i++)
+    // Vertical pass is the union of all rows in the window
+    mask.reset(rows.Width, rows.Height);
+    for (int y = 0; y < (int)rows.Height; y++)
     {
-        data[i] = tempData[i];
+        row.clear();
+        int firstRow = std::max(0, y - halfSquare);
+        int lastRow = std::min((int)rows.Height - 1, y + halfSquare);
+        row.insert(row.end(), rows.Runs.begin() + rows.Rows[firstRow], rows.Runs.begin() + rows.Rows[lastRow + 1]);
+        mask.appendRow(row);
     }
-    delete (tempData);
 }
 
-void Image::Dilation(unsigned char *data, int width)
+static uint64 ShiftedWord(BitMask &mask, uint32 y, uint32 word, int shift, bool vertical)
+{
+    if (!vertical)
+        return mask.shiftedWord(y, word, shift);
+    int row = (int)y + shift;
+    return row >= 0 && row < (int)mask.Height ? mask.Words[row * mask.WordsPerRow + word] : 0;
+}
+
+// Combines every pixel with those up to half away along its row or column,
+// pixels outside the image are 0. Each step combines the windows on both
+// sides at most their own reach away, so the window grows to 2 * half + 1
+// in log(half) passes instead of one pass per window pixel.
+static void CombineWindow(BitMask &mask, int half, bool vertical, bool maximum)
+{
+    BitMask combined;
+    combined.reset(mask.Width, mask.Height);
+    for (int reach = 0; reach < half;)
+    {
+        int step = std::min(std::max(reach, 1), half - reach);
+        for (uint32 y = 0; y < mask.Height; y++)
+            for (uint32 word = 0; word < mask.WordsPerRow; word++)
+            {
+                uint32 index = y * mask.WordsPerRow + word;
+                uint64 before = ShiftedWord(mask, y, word, -step, vertical);
+                uint64 after = ShiftedWord(mask, y, word, step, vertical);
+                combined.Words[index] = maximum ? mask.Words[index] | before | after : mask.Words[index] & before & after;
+            }
+        std::swap(mask.Words, combined.Words);
+        reach += step;
+    }
+}
+
+// Windows reaching outside the image are eroded
+void Image::Erosion(BitMask &mask, int XWidth, int YWidth)
+{
+    int halfY = YWidth % 2 == 0 ? YWidth / 2 : (YWidth - 1) / 2;
+    int halfX = XWidth % 2 == 0 ? XWidth / 2 : (XWidth - 1) / 2;
+
+    CombineWindow(mask, halfX, false, false);
+    CombineWindow(mask, halfY, true, false);
+}
+
+void Image::Dilation(BitMask &mask, int width)
 {
-    unsigned char *tempData = new unsigned char[getImageSize()];
-    uint16 L = pow(2, _bps);
     int halfSquare = (width - 1) / 2;
+    // Bits past the image width in the last word of a row must stay clear
+    uint64 lastWordMask = mask.Width % 64 == 0 ? ~(uint64)0 : ((uint64)1 << (mask.Width % 64)) - 1;
+
+    CombineWindow(mask, halfSquare, false, true);
+    for (uint32 y = 0; mask.WordsPerRow > 0 && y < mask.Height; y++)
+    {
+        mask.Words[(y + 1) * mask.WordsPerRow - 1] &= lastWordMask;
+    }
+    CombineWindow(mask, halfSquare, true, true);
+}
+
+void Image::Opening(BitMask &mask, int width)
+{
+    Erosion(mask, width, width);
+    Dilation(mask, width);
+}
+
+void Image::Closing(BitMask &mask, int width)
+{
+    Dilation(mask, width);
+    Erosion(mask, width, width);
+}
+
+// Reconstruction by dilation of marker under mask (Vincent's hybrid
+// algorithm): two raster scans propagate most values, a FIFO queue finishes
+// from the pixels that can still grow. The result replaces marker, which
+// must not exceed mask.
+void Image::ReconstructByDilation(unsigned char *marker, unsigned char *mask, Connectivity connectivity)
+{
+    int width = _width;
+    int height = _height;
+    // Neighbours before a pixel in raster order, the ones after are mirrored
+    int offsetsX[4] = {-1, 0, -1, 1};
+    int offsetsY[4] = {0, -1, -1, -1};
+    int neighbourCount = connectivity == N8 ? 4 : 2;
+
+    for (int y = 0; y < height; y++)
+        for (int x = 0; x < width; x++)
+        {
+            int index = y * width + x;
+            unsigned char value = marker[index];
+            for (int neighbour = 0; neighbour < neighbourCount; neighbour++)
+            {
+                int otherX = x + offsetsX[neighbour];
+                int otherY = y + offsetsY[neighbour];
+                if (otherX >= 0 && otherY >= 0 && otherX < width)
+                    value = std::max(value, marker[otherY * width + otherX]);
+            }
+            marker[index] = std::min(value, mask[index]);
+        }
 
-    for (int y = 0; y < _height; y++)
-        for (int x = 0; x < _width; x++)
+    std::queue<uint32> queue;
+    for (int y = height - 1; y >= 0; y--)
+        for (int x = width - 1; x >= 0; x--)
         {
-            tempData[y * _width + x] = MIN_INTENSITY;
-            for (int y2 = -halfSquare; y2 <= halfSquare; y2++)
-                for (int x2 = -halfSquare; x2 <= halfSquare; x2++)
+            int index = y * width + x;
+            unsigned char value = marker[index];
+            for (int neighbour = 0; neighbour < neighbourCount; neighbour++)
+            {
+                int otherX = x - offsetsX[neighbour];
+                int otherY = y - offsetsY[neighbour];
+                if (otherX >= 0 && otherY < height && otherX < width)
+                    value = std::max(value, marker[otherY * width + otherX]);
+            }
+            value = std::min(value, mask[index]);
+            marker[index] = value;
+
+            // A later neighbour that can still grow from here seeds the queue
+            for (int neighbour = 0; neighbour < neighbourCount; neighbour++)
+            {
+                int otherX = x - offsetsX[neighbour];
+                int otherY = y - offsetsY[neighbour];
+                if (otherX < 0 || otherY >= height || otherX >= width)
+                    continue;
+                int other = otherY * width + otherX;
+                if (marker[other] < value && marker[other] < mask[other])
                 {
-                    int selectedX = x + x2;
-                    int selectedY = y + y2;
-                    if (selectedX >= 0 && selectedY >= 0 && selectedX < _width && selectedY < _height)
-                    {
-                        if (data[y * _width + x] == MAX_INTENSITY)
-                        {
-                            tempData[selectedY * _width + selectedX] = MAX_INTENSITY;
-                        }
-                    }
+                    queue.push(index);
+                    break;
                 }
+            }
         }
 
-    for (uint32 i = 0; i < getImageSize(); i++)
+    while (!queue.empty())
     {
-        data[i] = tempData[i];
+        int index = queue.front();
+        queue.pop();
+        int x = index % width;
+        int y = index / width;
+        for (int neighbour = 0; neighbour < 2 * neighbourCount; neighbour++)
+        {
+            int sign = neighbour < neighbourCount ? 1 : -1;
+            int otherX = x + sign * offsetsX[neighbour % neighbourCount];
+            int otherY = y + sign * offsetsY[neighbour % neighbourCount];
+            if (otherX < 0 || otherY < 0 || otherX >= width || otherY >= height)
+                continue;
+            int other = otherY * width + otherX;
+            if (marker[other] < marker[index] && marker[other] != mask[other])
+            {
+                marker[other] = std::min(marker[index], mask[other]);
+                queue.push(other);
+            }
+        }
     }
-    delete (tempData);
 }
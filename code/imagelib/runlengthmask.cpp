@@ -0,0 +1,120 @@
+#include "image.hpp"
+
+void RunLengthMask::reset(uint32 width, uint32 height)
+{
+    Width = width;
+    Height = height;
+    Rows.assign(1, 0);
+    Runs.clear();
+}
+
+void RunLengthMask::appendRow(std::vector<MaskRun> &runs)
+{
+    // Sort and merge overlapping or touching runs into the next row
+    std::sort(runs.begin(), runs.end(), [](const MaskRun &a, const MaskRun &b) { return a.Start < b.Start; });
+    uint32 rowStart = Runs.size();
+    for (MaskRun &run : runs)
+    {
+        if (run.Start >= run.End)
+            continue;
+        if (Runs.size() > rowStart && run.Start <= Runs.back().End)
+        {
+            Runs.back().End = std::max(Runs.back().End, run.End);
+            continue;
+        }
+        Runs.push_back(MaskRun(run.Start, run.End));
+    }
+    Rows.push_back(Runs.size());
+}
+
+void RunLengthMask::toData(unsigned char *data, unsigned char background, unsigned char foreground)
+{
+    memset(data, background, Width * Height);
+    for (uint32 y = 0; y < Height; y++)
+        for (uint32 run = Rows[y]; run < Rows[y + 1]; run++)
+        {
+            memset(data + y * Width + Runs[run].Start, foreground, Runs[run].End - Runs[run].Start);
+        }
+}
+
+uint32 RunLengthMask::area()
+{
+    uint32 area = 0;
+    for (MaskRun &run : Runs)
+    {
+        area += run.End - run.Start;
+    }
+    return area;
+}
+
+BBox RunLengthMask::bounds()
+{
+    BBox box;
+    box.min_x = Width;
+    box.min_y = Height;
+    box.max_x = -1;
+    box.max_y = -1;
+    for (uint32 y = 0; y < Height; y++)
+    {
+        if (Rows[y] == Rows[y + 1])
+            continue;
+        box.min_y = std::min(box.min_y, (float)y);
+        box.max_y = y;
+        box.min_x = std::min(box.min_x, (float)Runs[Rows[y]].Start);
+        box.max_x = std::max(box.max_x, (float)Runs[Rows[y + 1] - 1].End - 1);
+    }
+    return box;
+}
+
+void RunLengthMask::complement(RunLengthMask &result)
+{
+    // Background runs are the gaps between foreground runs
+    result.reset(Width, Height);
+    for (uint32 y = 0; y < Height; y++)
+    {
+        uint32 x = 0;
+        for (uint32 run = Rows[y]; run < Rows[y + 1]; run++)
+        {
+            if (Runs[run].Start > x)
+                result.Runs.push_back(MaskRun(x, Runs[run].Start));
+            x = Runs[run].End;
+        }
+        if (x < Width)
+            result.Runs.push_back(MaskRun(x, Width));
+        result.Rows.push_back(result.Runs.size());
+    }
+}
+
+uint32 RunLengthMask::flood(uint32 seed, std::vector<bool> &reached, std::vector<uint32> &runs)
+{
+    // Breadth first over runs sharing a column with a run in the row above or below.
+    // Appends every newly reached run to runs and returns their pixel count.
+    uint32 area = 0;
+    uint32 next = runs.size();
+    if (reached[seed])
+        return 0;
+    reached[seed] = true;
+    runs.push_back(seed);
+    while (next < runs.size())
+    {
+        uint32 run = runs[next++];
+        area += Runs[run].End - Runs[run].Start;
+        uint32 y = std::upper_bound(Rows.begin(), Rows.end(), run) - Rows.begin() - 1;
+        for (int neighbourY = (int)y - 1; neighbourY <= (int)y + 1; neighbourY += 2)
+        {
+            if (neighbourY < 0 || neighbourY >= (int)Height)
+                continue;
+            // First run of the neighbouring row ending after this run starts
+            auto first = std::upper_bound(Runs.begin() + Rows[neighbourY], Runs.begin() + Rows[neighbourY + 1], Runs[run].Start,
+                                          [](uint32 start, const MaskRun &other) { return start < other.End; });
+            for (uint32 other = first - Runs.begin(); other < Rows[neighbourY + 1] && Runs[other].Start < Runs[run].End; other++)
+            {
+                if (reached[other])
+                    continue;
+                reached[other] = true;
+                runs.push_back(other);
+            }
+        }
+    }
+    return area;
+}
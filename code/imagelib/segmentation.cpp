@@ -1,5 +1,31 @@
 #include "image.hpp"
 
+void ComponentTable::resize(int count)
+{
+    Intensity.assign(count, 0);
+    Area.assign(count, 0);
+    MinX.assign(count, std::numeric_limits<int>::max());
+    MaxX.assign(count, -1);
+    MinY.assign(count, std::numeric_limits<int>::max());
+    MaxY.assign(count, -1);
+    CentroidX.assign(count, 0.0f);
+    CentroidY.assign(count, 0.0f);
+    Perimeter.assign(count, 0);
+}
+
+int ComponentTable::size() { return Area.size(); }
+
+uint32 ComponentOverlap::count(int mainLabel, int sideLabel)
+{
+    std::vector<std::pair<int, uint32>> &row = Overlaps[mainLabel];
+    auto entry = std::lower_bound(row.begin(), row.end(), std::make_pair(sideLabel, (uint32)0));
+    if (entry == row.end() || entry->first != sideLabel)
+    {
+        return 0;
+    }
+    return entry->second;
+}
+
 void Image::Treshold(unsigned char *data, int treshold)
 {
     for (uint32 i = 0; i < getImageSize(); i++)
@@ -8,6 +34,42 @@ void Image::Treshold(unsigned char *data, int treshold)
     }
 }
 
+void Image::Treshold(unsigned char *data, int treshold, RunLengthMask &mask)
+{
+    // Foreground pixels go straight into runs, data is left untouched
+    mask.reset(_width, _height);
+    for (uint32 y = 0; y < _height; y++)
+    {
+        unsigned char *row = data + y * _width;
+        uint32 x = 0;
+        while (x < _width)
+        {
+            while (x < _width && row[x] <= treshold)
+                x++;
+            uint32 start = x;
+            while (x < _width && row[x] > treshold)
+                x++;
+            if (x > start)
+                mask.Runs.push_back(MaskRun(start, x));
+        }
+        mask.Rows.push_back(mask.Runs.size());
+    }
+}
+
+void Image::Treshold(unsigned char *data, int treshold, BitMask &mask)
+{
+    mask.reset(_width, _height);
+    for (uint32 y = 0; y < _height; y++)
+    {
+        unsigned char *row = data + y * _width;
+        uint64 *words = mask.Words.data() + y * mask.WordsPerRow;
+        for (uint32 x = 0; x < _width; x++)
+        {
+            words[x / 64] |= (uint64)(row[x] > treshold) << (x % 64);
+        }
+    }
+}
+
 void Image::TresholdReverse(unsigned char *data, int treshold)
 {
     for (uint32 i = 0; i < getImageSize(); i++)
@@ -17,124 +79,502 @@ void Image::TresholdReverse(unsigned char *data, int treshold)
     }
 }
 
-void Image::LabelComponent(unsigned char *data, int *labels, Component &component, uint32 x, uint32 y)
+// Lock-free union-find over pixel indices. Every label is the index of a
+// pixel and roots are always the smallest index of their tree, i.e. the
+// first pixel of the component in raster order.
+static int FindRoot(std::atomic<int> *parent, int label)
 {
-    int index = x + _width * y;
-
-    if (labels[index] != -1)
+    int next = parent[label].load(std::memory_order_relaxed);
+    while (next != label)
     {
-        // Pixel already labeled
-        return;
+        label = next;
+        next = parent[label].load(std::memory_order_relaxed);
     }
-    if (data[index] != component.Intensity)
+    return label;
+}
+
+static void UnionLabels(std::atomic<int> *parent, int a, int b)
+{
+    while (true)
     {
-        // Pixel not same intensity as component
-        return;
+        a = FindRoot(parent, a);
+        b = FindRoot(parent, b);
+        if (a == b)
+            return;
+        if (a > b)
+            std::swap(a, b);
+
+        // Link larger root below smaller one, retry if another thread got there first
+        int expected = b;
+        if (parent[b].compare_exchange_weak(expected, a))
+            return;
     }
+}
+
+void Image::LabelRows(unsigned char *data, std::atomic<int> *parent, uint32 firstRow, uint32 lastRow, Connectivity connectivity)
+{
+    for (uint32 y = firstRow; y < lastRow; y++)
+    {
+        for (uint32 x = 0; x < _width; x++)
+        {
+            int index = x + _width * y;
+            unsigned char intensity = data[index];
+
+            // Already visited neighbours inside this band; N8 adds the two upper diagonals
+            int neighbours[4];
+            int neighbourCount = 0;
+            if (x > 0 && data[index - 1] == intensity)
+                neighbours[neighbourCount++] = index - 1;
+            if (y > firstRow)
+            {
+                if (data[index - _width] == intensity)
+                    neighbours[neighbourCount++] = index - _width;
+                if (connectivity == N8 && x > 0 && data[index - _width - 1] == intensity)
+                    neighbours[neighbourCount++] = index - _width - 1;
+                if (connectivity == N8 && x < _width - 1 && data[index - _width + 1] == intensity)
+                    neighbours[neighbourCount++] = index - _width + 1;
+            }
 
-    // Adding pixel to this component
-    labels[index] = component.Label;
-    component.Pixels.push_back(index);
+            if (neighbourCount == 0)
+            {
+                // New provisional label
+                parent[index].store(index, std::memory_order_relaxed);
+                continue;
+            }
 
-    // We are using N4 connectivity scheme
-    if (x > 0)
-        LabelComponent(data, labels, component, x - 1, y);
-    if (x < _width - 1)
-        LabelComponent(data, labels, component, x + 1, y);
-    if (y > 0)
-        LabelComponent(data, labels, component, x, y - 1);
-    if (y < _height - 1)
-        LabelComponent(data, labels, component, x, y + 1);
+            parent[index].store(FindRoot(parent, neighbours[0]), std::memory_order_relaxed);
+            for (int i = 1; i < neighbourCount; i++)
+            {
+                UnionLabels(parent, index, neighbours[i]);
+            }
+        }
+    }
+}
+
+void Image::MergeRows(unsigned char *data, std::atomic<int> *parent, uint32 row, Connectivity connectivity)
+{
+    // Join labels of the first row of a band with the last row of the band above
+    for (uint32 x = 0; x < _width; x++)
+    {
+        int index = x + _width * row;
+        unsigned char intensity = data[index];
+        if (data[index - _width] == intensity)
+            UnionLabels(parent, index, index - _width);
+        if (connectivity == N8 && x > 0 && data[index - _width - 1] == intensity)
+            UnionLabels(parent, index, index - _width - 1);
+        if (connectivity == N8 && x < _width - 1 && data[index - _width + 1] == intensity)
+            UnionLabels(parent, index, index - _width + 1);
+    }
 }
 
-void Image::CCL(unsigned char *data, int *labels, std::vector<Component> &components)
+void Image::CCL(unsigned char *data, ComponentTable &components, Connectivity connectivity)
 {
-    components.clear();
-    // Set labels of all pixels to nonexistent
-    for (uint32 index = 0; index < getImageSize(); index++)
+    uint32 pixelCount = _width * _height;
+    components.Labels.resize(pixelCount);
+    if (pixelCount == 0)
+    {
+        // No bands to label or merge
+        components.resize(0);
+        return;
+    }
+    int *labels = components.Labels.data();
+    std::atomic<int> *parent = new std::atomic<int>[pixelCount];
+
+    // Label row bands independently, then merge labels across band borders
+    uint32 bands = std::min<uint32>(getThreadCount(), _height);
+    std::vector<uint32> bandRows(bands + 1);
+    for (uint32 band = 0; band <= bands; band++)
+    {
+        bandRows[band] = (uint32)((uint64)_height * band / bands);
+    }
+
+    RunInParallel(bands, [&](unsigned long band) {
+        LabelRows(data, parent, bandRows[band], bandRows[band + 1], connectivity);
+    });
+    RunInParallel(bands - 1, [&](unsigned long band) {
+        MergeRows(data, parent, bandRows[band + 1], connectivity);
+    });
+
+    // Number roots in raster order, band by band, so labels match a serial scan
+    std::vector<int> bandLabels(bands + 1, 0);
+    RunInParallel(bands, [&](unsigned long band) {
+        for (uint32 index = bandRows[band] * _width; index < bandRows[band + 1] * _width; index++)
+        {
+            if (parent[index].load(std::memory_order_relaxed) == (int)index)
+                bandLabels[band + 1]++;
+        }
+    });
+    for (uint32 band = 0; band < bands; band++)
     {
-        labels[index] = -1;
+        bandLabels[band + 1] += bandLabels[band];
     }
+    RunInParallel(bands, [&](unsigned long band) {
+        int labelNo = bandLabels[band];
+        for (uint32 index = bandRows[band] * _width; index < bandRows[band + 1] * _width; index++)
+        {
+            if (parent[index].load(std::memory_order_relaxed) == (int)index)
+                labels[index] = labelNo++;
+        }
+    });
+    RunInParallel(bands, [&](unsigned long band) {
+        for (uint32 index = bandRows[band] * _width; index < bandRows[band + 1] * _width; index++)
+        {
+            int root = FindRoot(parent, index);
+            if (root != (int)index)
+                labels[index] = labels[root];
+        }
+    });
+    delete[] parent;
 
-    int labelNo = 0;
+    // Single pass over the label image for all component statistics
+    int componentCount = bandLabels[bands];
+    components.resize(componentCount);
+    std::vector<double> sumX(componentCount, 0.0);
+    std::vector<double> sumY(componentCount, 0.0);
     for (uint32 y = 0; y < _height; y++)
     {
         for (uint32 x = 0; x < _width; x++)
         {
             uint32 index = x + _width * y;
-            if (labels[index] != -1)
+            int label = labels[index];
+            if (components.Area[label] == 0)
             {
-                continue; // Pixel already labeled
+                components.Intensity[label] = data[index];
+                components.MinY[label] = y;
             }
+            components.Area[label]++;
+            components.MaxY[label] = y;
+            if ((int)x < components.MinX[label])
+                components.MinX[label] = x;
+            if ((int)x > components.MaxX[label])
+                components.MaxX[label] = x;
+            sumX[label] += x;
+            sumY[label] += y;
 
-            // Unlabeled pixel = new component
-            Component component;
-            component.Intensity = data[index];
-            component.Label = labelNo;
-            LabelComponent(data, labels, component, x, y);
-
-            components.push_back(component);
-            labelNo++;
+            // Perimeter counts pixel edges on the image border or facing another component
+            if (x == 0 || labels[index - 1] != label)
+                components.Perimeter[label]++;
+            if (x == _width - 1 || labels[index + 1] != label)
+                components.Perimeter[label]++;
+            if (y == 0 || labels[index - _width] != label)
+                components.Perimeter[label]++;
+            if (y == _height - 1 || labels[index + _width] != label)
+                components.Perimeter[label]++;
         }
     }
+    for (int label = 0; label < componentCount; label++)
+    {
+        components.CentroidX[label] = sumX[label] / components.Area[label];
+        components.CentroidY[label] = sumY[label] / components.Area[label];
+    }
 }
 
-void Image::FillHoles(unsigned char *data, int *labels, int componentToSkip)
+static int FindRunRoot(std::vector<int> &parent, int run)
 {
-    for (uint32 index = 0; index < getImageSize(); index++)
+    while (parent[run] != run)
+    {
+        parent[run] = parent[parent[run]];
+        run = parent[run];
+    }
+    return run;
+}
+
+void Image::CCL(RunLengthMask &mask, ComponentTable &components, Connectivity connectivity)
+{
+    uint32 runCount = mask.Runs.size();
+    std::vector<int> parent(runCount);
+    // Perimeter of each run before removing edges shared with the rows above and below
+    std::vector<uint32> runPerimeter(runCount);
+    // N8 also joins runs that only touch diagonally
+    uint32 touch = connectivity == N8 ? 1 : 0;
+
+    for (uint32 y = 0; y < mask.Height; y++)
+    {
+        uint32 above = y > 0 ? mask.Rows[y - 1] : 0;
+        uint32 aboveEnd = y > 0 ? mask.Rows[y] : 0;
+        for (uint32 run = mask.Rows[y]; run < mask.Rows[y + 1]; run++)
+        {
+            MaskRun &current = mask.Runs[run];
+            parent[run] = run;
+            runPerimeter[run] += 2 + 2 * (current.End - current.Start);
+
+            // Runs of the row above are sorted, skip those ending before this one
+            while (above < aboveEnd && mask.Runs[above].End + touch <= current.Start)
+                above++;
+            for (uint32 other = above; other < aboveEnd && mask.Runs[other].Start < current.End + touch; other++)
+            {
+                // Smaller run index stays root so roots are first in raster order
+                int a = FindRunRoot(parent, run);
+                int b = FindRunRoot(parent, other);
+                if (a < b)
+                    parent[b] = a;
+                else if (b < a)
+                    parent[a] = b;
+
+                uint32 shared = std::min(current.End, mask.Runs[other].End);
+                uint32 sharedStart = std::max(current.Start, mask.Runs[other].Start);
+                if (shared > sharedStart)
+                {
+                    runPerimeter[run] -= shared - sharedStart;
+                    runPerimeter[other] -= shared - sharedStart;
+                }
+            }
+        }
+    }
+
+    // Label 0 is the background, foreground components are numbered from 1
+    int labelNo = 1;
+    for (uint32 run = 0; run < runCount; run++)
     {
-        //skip selected component
-        if (labels[index] == componentToSkip)
+        int root = FindRunRoot(parent, run);
+        mask.Runs[run].Label = root == (int)run ? labelNo++ : mask.Runs[root].Label;
+    }
+
+    components.Labels.clear();
+    components.resize(labelNo);
+    std::vector<double> sumX(labelNo, 0.0);
+    std::vector<double> sumY(labelNo, 0.0);
+    for (uint32 y = 0; y < mask.Height; y++)
+        for (uint32 run = mask.Rows[y]; run < mask.Rows[y + 1]; run++)
         {
+            MaskRun &current = mask.Runs[run];
+            int label = current.Label;
+            uint32 length = current.End - current.Start;
+            if (components.Area[label] == 0)
+            {
+                components.Intensity[label] = MAX_INTENSITY;
+                components.MinY[label] = y;
+            }
+            components.Area[label] += length;
+            components.MaxY[label] = y;
+            components.MinX[label] = std::min(components.MinX[label], (int)current.Start);
+            components.MaxX[label] = std::max(components.MaxX[label], (int)current.End - 1);
+            components.Perimeter[label] += runPerimeter[run];
+            sumX[label] += (current.Start + current.End - 1) * 0.5 * length;
+            sumY[label] += (double)y * length;
+        }
+
+    // Background statistics are whatever is left of the image
+    double totalX = 0.5 * (mask.Width - 1) * mask.Width * mask.Height;
+    double totalY = 0.5 * (mask.Height - 1) * mask.Height * mask.Width;
+    uint32 background = mask.Width * mask.Height;
+    for (int label = 1; label < labelNo; label++)
+    {
+        background -= components.Area[label];
+        totalX -= sumX[label];
+        totalY -= sumY[label];
+    }
+    components.Intensity[0] = MIN_INTENSITY;
+    components.Area[0] = background;
+    components.MinX[0] = 0;
+    components.MinY[0] = 0;
+    components.MaxX[0] = mask.Width - 1;
+    components.MaxY[0] = mask.Height - 1;
+    sumX[0] = totalX;
+    sumY[0] = totalY;
+
+    for (int label = 0; label < labelNo; label++)
+    {
+        if (components.Area[label] == 0)
             continue;
+        components.CentroidX[label] = sumX[label] / components.Area[label];
+        components.CentroidY[label] = sumY[label] / components.Area[label];
+    }
+}
+
+// Marks every run connected to a run touching the image border
+static void FloodFromBorder(RunLengthMask &mask, std::vector<bool> &reached)
+{
+    reached.assign(mask.Runs.size(), false);
+    std::vector<uint32> runs;
+    for (uint32 y = 0; y < mask.Height; y++)
+        for (uint32 run = mask.Rows[y]; run < mask.Rows[y + 1]; run++)
+        {
+            if (y == 0 || y == mask.Height - 1 || mask.Runs[run].Start == 0 || mask.Runs[run].End == mask.Width)
+                mask.flood(run, reached, runs);
         }
+}
+
+void Image::FillHoles(RunLengthMask &mask)
+{
+    // Background not reachable from the border is a hole
+    RunLengthMask background;
+    mask.complement(background);
+    std::vector<bool> outside;
+    FloodFromBorder(background, outside);
 
-        data[index] = MAX_INTENSITY;
+    RunLengthMask filled;
+    filled.reset(mask.Width, mask.Height);
+    std::vector<MaskRun> row;
+    for (uint32 y = 0; y < mask.Height; y++)
+    {
+        row.clear();
+        for (uint32 run = mask.Rows[y]; run < mask.Rows[y + 1]; run++)
+        {
+            row.push_back(mask.Runs[run]);
+        }
+        for (uint32 run = background.Rows[y]; run < background.Rows[y + 1]; run++)
+        {
+            if (!outside[run])
+                row.push_back(background.Runs[run]);
+        }
+        filled.appendRow(row);
     }
+    mask = filled;
 }
 
-bool Image::ComponentInsideComponent(Component &outsideComponent, Component &insideComponent)
+void Image::FillHoles(unsigned char *data)
 {
-    for (uint32 pixel : insideComponent.Pixels)
+    // Holes are the background not reconstructed from the background on the border
+    uint32 pixelCount = _width * _height;
+    unsigned char *background = new unsigned char[pixelCount];
+    unsigned char *reconstructed = new unsigned char[pixelCount];
+    for (uint32 index = 0; index < pixelCount; index++)
+    {
+        uint32 x = index % _width;
+        uint32 y = index / _width;
+        background[index] = MAX_INTENSITY - data[index];
+        bool border = x == 0 || y == 0 || x == _width - 1 || y == _height - 1;
+        reconstructed[index] = border ? background[index] : MIN_INTENSITY;
+    }
+
+    ReconstructByDilation(reconstructed, background);
+    for (uint32 index = 0; index < pixelCount; index++)
     {
-        if (std::find(outsideComponent.Pixels.begin(), outsideComponent.Pixels.end(), pixel) != outsideComponent.Pixels.end())
+        data[index] = MAX_INTENSITY - reconstructed[index];
+    }
+    delete[] background;
+    delete[] reconstructed;
+}
+
+void Image::PaintComponent(unsigned char *data, ComponentTable &components, int label, int intensity)
+{
+    // Component pixels are recovered from the label image inside its bounding box
+    for (int y = components.MinY[label]; y <= components.MaxY[label]; y++)
+        for (int x = components.MinX[label]; x <= components.MaxX[label]; x++)
         {
-            continue;
+            uint32 index = y * _width + x;
+            if (components.Labels[index] == label)
+            {
+                data[index] = intensity;
+            }
         }
-        else
+}
+
+void Image::OverlapComponents(ComponentTable &mainComponents, ComponentTable &sideComponents, ComponentOverlap &overlap)
+{
+    // One scan over both label images counts pixels per (main, side) label pair
+    std::unordered_map<uint64, uint32> counts;
+    uint32 pixelCount = _width * _height;
+    uint32 index = 0;
+    while (index < pixelCount)
+    {
+        int mainLabel = mainComponents.Labels[index];
+        int sideLabel = sideComponents.Labels[index];
+
+        // Neighbouring pixels mostly share both labels, count the whole run at once
+        uint32 run = 1;
+        while (index + run < pixelCount && mainComponents.Labels[index + run] == mainLabel && sideComponents.Labels[index + run] == sideLabel)
         {
-            return false;
+            run++;
         }
+        counts[((uint64)mainLabel << 32) | (uint32)sideLabel] += run;
+        index += run;
     }
 
-    return true;
+    FillOverlap(counts, mainComponents.size(), overlap);
 }
 
-bool Image::ComponentsIntersect(Component &mainComponent, Component &sideComponent)
+void Image::OverlapComponents(RunLengthMask &mainMask, RunLengthMask &sideMask, ComponentOverlap &overlap)
 {
-    for (uint32 pixel : sideComponent.Pixels)
+    // Sweep the foreground runs of both masks row by row, only foreground pairs are counted
+    std::unordered_map<uint64, uint32> counts;
+    int mainCount = 1;
+    for (uint32 y = 0; y < mainMask.Height; y++)
     {
-        if (std::find(mainComponent.Pixels.begin(), mainComponent.Pixels.end(), pixel) != mainComponent.Pixels.end())
+        uint32 side = sideMask.Rows[y];
+        for (uint32 run = mainMask.Rows[y]; run < mainMask.Rows[y + 1]; run++)
+        {
+            MaskRun &main = mainMask.Runs[run];
+            mainCount = std::max(mainCount, main.Label + 1);
+            while (side < sideMask.Rows[y + 1] && sideMask.Runs[side].End <= main.Start)
+                side++;
+            for (uint32 other = side; other < sideMask.Rows[y + 1] && sideMask.Runs[other].Start < main.End; other++)
+            {
+                uint32 shared = std::min(main.End, sideMask.Runs[other].End) - std::max(main.Start, sideMask.Runs[other].Start);
+                counts[((uint64)main.Label << 32) | (uint32)sideMask.Runs[other].Label] += shared;
+            }
+        }
+    }
+
+    FillOverlap(counts, mainCount, overlap);
+}
+
+void Image::OverlapComponents(ComponentTable &mainComponents, RunLengthMask &sideMask, ComponentOverlap &overlap)
+{
+    // Only pixels under the side runs are visited
+    std::unordered_map<uint64, uint32> counts;
+    for (uint32 y = 0; y < sideMask.Height; y++)
+        for (uint32 run = sideMask.Rows[y]; run < sideMask.Rows[y + 1]; run++)
         {
-            return true;
+            MaskRun &side = sideMask.Runs[run];
+            uint32 x = side.Start;
+            while (x < side.End)
+            {
+                int mainLabel = mainComponents.Labels[y * _width + x];
+                uint32 start = x;
+                while (x < side.End && mainComponents.Labels[y * _width + x] == mainLabel)
+                    x++;
+                counts[((uint64)mainLabel << 32) | (uint32)side.Label] += x - start;
+            }
         }
+
+    FillOverlap(counts, mainComponents.size(), overlap);
+}
+
+void Image::FillOverlap(std::unordered_map<uint64, uint32> &counts, int mainCount, ComponentOverlap &overlap)
+{
+    overlap.Overlaps.assign(mainCount, std::vector<std::pair<int, uint32>>());
+    for (auto &count : counts)
+    {
+        overlap.Overlaps[count.first >> 32].push_back(std::make_pair((int)(count.first & 0xffffffff), count.second));
+    }
+    for (auto &row : overlap.Overlaps)
+    {
+        std::sort(row.begin(), row.end());
     }
+}
 
-    return false;
+void Image::PaintComponent(unsigned char *data, RunLengthMask &mask, int label, int intensity)
+{
+    for (uint32 y = 0; y < mask.Height; y++)
+        for (uint32 run = mask.Rows[y]; run < mask.Rows[y + 1]; run++)
+        {
+            if (mask.Runs[run].Label == label)
+            {
+                memset(data + y * mask.Width + mask.Runs[run].Start, intensity, mask.Runs[run].End - mask.Runs[run].Start);
+            }
+        }
 }
 
-bool Image::ComponentCenteredInsideComponent(Component &mainComponent, Component &insideComponent, int deltaError)
+bool Image::ComponentInsideComponent(ComponentOverlap &overlap, int outsideLabel, ComponentTable &insideComponents, int insideLabel)
 {
-    int minX, minY, maxX, maxY;
-    GetComponentBoundaries(mainComponent, minX, maxX, minY, maxY);
+    // Every pixel of the inside component is shared with the outside one
+    return overlap.count(outsideLabel, insideLabel) == insideComponents.Area[insideLabel];
+}
 
-    int mainComponentCenterX = (minX + maxX) / 2;
-    int mainComponentCenterY = (minY + maxY) / 2;
+bool Image::ComponentsIntersect(ComponentOverlap &overlap, int mainLabel, int sideLabel)
+{
+    return overlap.count(mainLabel, sideLabel) > 0;
+}
 
-    GetComponentBoundaries(insideComponent, minX, maxX, minY, maxY);
+bool Image::ComponentCenteredInsideComponent(ComponentTable &mainComponents, int mainLabel, ComponentTable &insideComponents, int insideLabel, int deltaError)
+{
+    int mainComponentCenterX = (mainComponents.MinX[mainLabel] + mainComponents.MaxX[mainLabel]) / 2;
+    int mainComponentCenterY = (mainComponents.MinY[mainLabel] + mainComponents.MaxY[mainLabel]) / 2;
 
-    int insideComponentCenterX = (minX + maxX) / 2;
-    int insideComponentCenterY = (minY + maxY) / 2;
+    int insideComponentCenterX = (insideComponents.MinX[insideLabel] + insideComponents.MaxX[insideLabel]) / 2;
+    int insideComponentCenterY = (insideComponents.MinY[insideLabel] + insideComponents.MaxY[insideLabel]) / 2;
 
     if (std::abs(mainComponentCenterX - insideComponentCenterX) > deltaError || std::abs(mainComponentCenterY - insideComponentCenterY) > deltaError)
     {
@@ -144,15 +584,12 @@ bool Image::ComponentCenteredInsideComponent(Component &mainComponent, Component
     return true;
 }
 
-bool Image::SolderingIslandCorrect(Component &component)
+bool Image::SolderingIslandCorrect(ComponentTable &components, int label)
 {
-    int minX, minY, maxX, maxY;
-    GetComponentBoundaries(component, minX, maxX, minY, maxY);
-
-    float diameterX = maxX - minX + 1;
-    float diameterY = maxY - minY + 1;
+    float diameterX = components.MaxX[label] - components.MinX[label] + 1;
+    float diameterY = components.MaxY[label] - components.MinY[label] + 1;
     float PIArea = M_PI * pow((diameterX) / 2.0, 2.0);
-    float area = component.Pixels.size();
+    float area = components.Area[label];
 
     if (abs(diameterX - diameterY) < diameterX / 10.0 && abs(area - PIArea) < area / 10.0)
     {
@@ -167,54 +604,67 @@ bool Image::SolderingIslandCorrect(Component &component)
     return false;
 }
 
-void Image::GetComponentBoundaries(Component &component, int &minX, int &maxX, int &minY, int &maxY)
+void Image::FilterComponents(unsigned char *data, ComponentTable &components, int fitlerIntensity)
 {
-    minX = 100000;
-    minY = 100000;
-    maxX = -1;
-    maxY = -1;
-
-    for (uint32 pixel : component.Pixels)
+    for (uint32 index = 0; index < _width * _height; index++)
     {
-        int x = pixel % _width;
-        int y = pixel / _width;
-        if (x > maxX)
-            maxX = x;
-        if (x < minX)
-            minX = x;
-        if (y > maxY)
-            maxY = y;
-        if (y < minY)
-            minY = y;
+        int label = components.Labels[index];
+        data[index] = components.Intensity[label] != fitlerIntensity ? MIN_INTENSITY : MAX_INTENSITY;
     }
 }
 
-void Image::FilterComponents(unsigned char *data, std::vector<Component> &components, int fitlerIntensity)
+void Image::FilterComponents(unsigned char *data, int filterIntensity)
 {
-    for (Component component : components)
+    // Components of one intensity are just its pixels, no labels needed
+    for (uint32 index = 0; index < _width * _height; index++)
     {
-        int intensity = component.Intensity != fitlerIntensity ? MIN_INTENSITY : MAX_INTENSITY;
+        data[index] = data[index] != filterIntensity ? MIN_INTENSITY : MAX_INTENSITY;
+    }
+}
 
-        for (uint32 background : component.Pixels)
+void Image::RemoveSmallComponents(ComponentTable &components, unsigned char *data, int size)
+{
+    for (uint32 index = 0; index < _width * _height; index++)
+    {
+        int label = components.Labels[index];
+        if (label == 0)
+            continue; // Skip background
+        if (components.Area[label] < (uint32)size)
         {
-
-            data[background] = intensity;
+            data[index] = MIN_INTENSITY;
         }
     }
 }
 
-void Image::RemoveSmallComponents(std::vector<Component> &components, unsigned char *data, int size)
+void Image::RemoveSmallComponents(RunLengthMask &mask, int size)
 {
-    for (Component component : components)
+    std::vector<bool> reached(mask.Runs.size(), false);
+    std::vector<bool> removed(mask.Runs.size(), false);
+    std::vector<uint32> runs;
+    for (uint32 seed = 0; seed < mask.Runs.size(); seed++)
     {
-        if (component.Label == 0)
-            continue; // Skip background
-        if (component.Pixels.size() < 10)
+        if (reached[seed])
+            continue;
+        runs.clear();
+        if (mask.flood(seed, reached, runs) < (uint32)size)
         {
-            for (uint32 pixel : component.Pixels)
+            for (uint32 run : runs)
             {
-                data[pixel] = MIN_INTENSITY;
+                removed[run] = true;
             }
         }
     }
+
+    RunLengthMask kept;
+    kept.reset(mask.Width, mask.Height);
+    for (uint32 y = 0; y < mask.Height; y++)
+    {
+        for (uint32 run = mask.Rows[y]; run < mask.Rows[y + 1]; run++)
+        {
+            if (!removed[run])
+                kept.Runs.push_back(mask.Runs[run]);
+        }
+        kept.Rows.push_back(kept.Runs.size());
+    }
+    mask = kept;
 }
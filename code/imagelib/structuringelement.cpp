@@ -0,0 +1,113 @@
+#include "image.hpp"
+
+StructuringElement::StructuringElement(Shape shape, int size, float degrees)
+{
+    switch (shape)
+    {
+    case Disk:
+    {
+        int radius = size;
+        if (radius > 3)
+        {
+            // Octagon from a horizontal, vertical and two diagonal lines. Its
+            // extent along the axes and diagonals both equal the radius.
+            int diagonal = (int)round(radius * (1.0 - 1.0 / sqrt(2.0)));
+            int straight = radius - 2 * diagonal;
+            Chain.push_back(LineStep(1, 0, straight, straight));
+            Chain.push_back(LineStep(0, 1, straight, straight));
+            Chain.push_back(LineStep(1, 1, diagonal, diagonal));
+            Chain.push_back(LineStep(1, -1, diagonal, diagonal));
+            break;
+        }
+        for (int dy = -radius; dy <= radius; dy++)
+        {
+            int half = (int)floor(sqrt((double)(radius * radius - dy * dy)));
+            Runs.push_back(ElementRun(dy, -half, half));
+        }
+        break;
+    }
+    case Line:
+    {
+        int before = (size - 1) / 2;
+        int after = size / 2;
+        float angle = fmod(fmod(degrees, 180.0f) + 180.0f, 180.0f);
+        // Image rows grow downwards, so positive angles step up
+        if (angle == 0 || angle == 45 || angle == 90 || angle == 135)
+        {
+            int stepX = angle == 90 ? 0 : (angle == 135 ? -1 : 1);
+            int stepY = angle == 0 ? 0 : -1;
+            Chain.push_back(LineStep(stepX, stepY, before, after));
+            break;
+        }
+
+        // Other angles are rasterized, pixels of a row along a line are contiguous
+        float radians = angle * M_PI / 180.0f;
+        int reach = (int)ceil(std::max(before, after) * fabs(sin(radians)));
+        std::vector<int> minX(2 * reach + 1, std::numeric_limits<int>::max());
+        std::vector<int> maxX(2 * reach + 1, std::numeric_limits<int>::min());
+        for (int step = -before; step <= after; step++)
+        {
+            int dx = (int)round(step * cos(radians));
+            int dy = (int)round(-step * sin(radians));
+            minX[dy + reach] = std::min(minX[dy + reach], dx);
+            maxX[dy + reach] = std::max(maxX[dy + reach], dx);
+        }
+        for (int dy = -reach; dy <= reach; dy++)
+        {
+            if (minX[dy + reach] <= maxX[dy + reach])
+                Runs.push_back(ElementRun(dy, minX[dy + reach], maxX[dy + reach]));
+        }
+        break;
+    }
+    case Cross:
+    {
+        int half = (size - 1) / 2;
+        for (int dy = -half; dy <= half; dy++)
+        {
+            Runs.push_back(dy == 0 ? ElementRun(dy, -half, half) : ElementRun(dy, 0, 0));
+        }
+        break;
+    }
+    }
+}
+
+StructuringElement::StructuringElement(int XWidth, int YWidth)
+{
+    // Rectangles are separable into a row and a column line
+    Chain.push_back(LineStep(1, 0, (XWidth - 1) / 2, XWidth / 2));
+    Chain.push_back(LineStep(0, 1, (YWidth - 1) / 2, YWidth / 2));
+}
+
+StructuringElement::StructuringElement(unsigned char *mask, int width, int height)
+{
+    // Nonzero mask entries are members, the origin is the center of the mask
+    for (int y = 0; y < height; y++)
+    {
+        int x = 0;
+        while (x < width)
+        {
+            while (x < width && mask[y * width + x] == 0)
+                x++;
+            int start = x;
+            while (x < width && mask[y * width + x] != 0)
+                x++;
+            if (x > start)
+                Runs.push_back(ElementRun(y - height / 2, start - width / 2, x - 1 - width / 2));
+        }
+    }
+}
+
+int StructuringElement::reach()
+{
+    // Rows above or below the origin the element can touch
+    int reach = 0;
+    for (LineStep &step : Chain)
+    {
+        reach += abs(step.StepY) * std::max(step.Before, step.After);
+    }
+    for (ElementRun &run : Runs)
+    {
+        reach = std::max(reach, abs(run.DY));
+    }
+    return reach;
+}
@@ -0,0 +1,85 @@
+#include "image.hpp"
+
+#include <algorithm>
+
+ThreadPool &ThreadPool::instance()
+{
+  static ThreadPool pool;
+  return pool;
+}
+
+ThreadPool::~ThreadPool()
+{
+  {
+    std::lock_guard<std::mutex> guard(_lock);
+    _stopping = true;
+  }
+  _wake.notify_all();
+  for (std::thread &worker : _workers)
+  {
+    worker.join();
+  }
+}
+
+void ThreadPool::run(unsigned long jobs, const std::function<void(unsigned long)> &job)
+{
+  if (jobs <= 1)
+  {
+    if (jobs == 1)
+      job(0);
+    return;
+  }
+
+  ThreadPool &pool = instance();
+  std::shared_ptr<Batch> batch = std::make_shared<Batch>();
+  batch->Job = &job;
+  batch->Jobs = jobs;
+
+  std::unique_lock<std::mutex> lock(pool._lock);
+  // Workers only ever grow to the largest batch seen, the caller is one of them
+  while (pool._workers.size() < jobs - 1)
+  {
+    pool._workers.push_back(std::thread(&ThreadPool::work, &pool));
+  }
+  pool._batches.push_back(batch);
+  pool._wake.notify_all();
+
+  while (pool.runNext(lock, batch))
+  {
+  }
+  pool._done.wait(lock, [&] { return batch->Finished == batch->Jobs; });
+}
+
+// Claims and runs the next job of batch, false when all are claimed. The
+// lock is released while the job runs.
+bool ThreadPool::runNext(std::unique_lock<std::mutex> &lock, std::shared_ptr<Batch> batch)
+{
+  if (batch->Next == batch->Jobs)
+    return false;
+  unsigned long index = batch->Next++;
+  if (batch->Next == batch->Jobs)
+  {
+    _batches.erase(std::find(_batches.begin(), _batches.end(), batch));
+  }
+
+  lock.unlock();
+  (*batch->Job)(index);
+  lock.lock();
+  if (++batch->Finished == batch->Jobs)
+  {
+    _done.notify_all();
+  }
+  return true;
+}
+
+void ThreadPool::work()
+{
+  std::unique_lock<std::mutex> lock(_lock);
+  while (true)
+  {
+    _wake.wait(lock, [&] { return _stopping || !_batches.empty(); });
+    if (_batches.empty())
+      return;
+    runNext(lock, _batches.front());
+  }
+}
@@ -0,0 +1,173 @@
+#include "image.hpp"
+
+TiffTileCache::TiffTileCache(std::string filename, size_t capacity, uint16 level) : _chunks(capacity)
+{
+  _tiff = TIFFOpen(filename.c_str(), "r");
+  if (_tiff == nullptr)
+  {
+    std::cout << "Could not open " << filename << std::endl;
+    return;
+  }
+  std::vector<TiffLevel> levels = Image::getTiffLevels(_tiff);
+  if (level >= levels.size())
+  {
+    std::cout << "No level " << level << " in " << filename << std::endl;
+    TIFFClose(_tiff);
+    _tiff = nullptr;
+    return;
+  }
+  TIFFSetDirectory(_tiff, levels[level].Directory);
+  TIFFGetField(_tiff, TIFFTAG_IMAGEWIDTH, &_width);
+  TIFFGetField(_tiff, TIFFTAG_IMAGELENGTH, &_height);
+  TIFFGetFieldDefaulted(_tiff, TIFFTAG_BITSPERSAMPLE, &_bps);
+  TIFFGetFieldDefaulted(_tiff, TIFFTAG_SAMPLESPERPIXEL, &_channels);
+  uint16 planar = PLANARCONFIG_CONTIG;
+  TIFFGetFieldDefaulted(_tiff, TIFFTAG_PLANARCONFIG, &planar);
+  if (planar != PLANARCONFIG_CONTIG && _channels > 1)
+  {
+    std::cout << "Only interleaved tiffs are supported" << std::endl;
+    TIFFClose(_tiff);
+    _tiff = nullptr;
+    return;
+  }
+
+  // Strips are chunks spanning the whole width
+  if (TIFFIsTiled(_tiff))
+  {
+    TIFFGetField(_tiff, TIFFTAG_TILEWIDTH, &_chunkWidth);
+    TIFFGetField(_tiff, TIFFTAG_TILELENGTH, &_chunkHeight);
+    _chunkColumns = (_width + _chunkWidth - 1) / _chunkWidth;
+  }
+  else
+  {
+    _chunkWidth = _width;
+    _chunkHeight = _height;
+    TIFFGetFieldDefaulted(_tiff, TIFFTAG_ROWSPERSTRIP, &_chunkHeight);
+    _chunkHeight = std::min(_chunkHeight, _height);
+
+    // Strips that would decode to more than MAX_STRIP_BYTES, often the whole
+    // image as one strip, are read as bands of scanlines instead
+    tmsize_t lineSize = TIFFScanlineSize(_tiff);
+    if (lineSize > 0 && (uint64)_chunkHeight * lineSize > MAX_STRIP_BYTES)
+    {
+      _scanlines = true;
+      _stripRows = _chunkHeight;
+      _chunkHeight = std::max<uint32>(1, MAX_STRIP_BYTES / lineSize);
+    }
+  }
+}
+
+TiffTileCache::~TiffTileCache()
+{
+  if (_tiff != nullptr)
+  {
+    TIFFClose(_tiff);
+  }
+}
+
+bool TiffTileCache::isOpen()
+{
+  return _tiff != nullptr;
+}
+
+uint32 TiffTileCache::getWidth() { return _width; }
+uint32 TiffTileCache::getHeight() { return _height; }
+uint16 TiffTileCache::getChannels() { return _channels; }
+uint16 TiffTileCache::getBitsPerSample() { return _bps; }
+
+// Decoded tile or strip, nullptr when it can not be read. Decoding holds the
+// lock, the libtiff handle is not thread safe.
+std::shared_ptr<const std::vector<unsigned char>> TiffTileCache::getChunk(uint32 chunk)
+{
+  std::lock_guard<std::mutex> guard(_lock);
+  std::shared_ptr<const std::vector<unsigned char>> cached = _chunks.find(chunk);
+  if (cached != nullptr)
+    return cached;
+
+  std::shared_ptr<std::vector<unsigned char>> pixels;
+  if (TIFFIsTiled(_tiff))
+  {
+    pixels = std::make_shared<std::vector<unsigned char>>(TIFFTileSize(_tiff));
+    if (TIFFReadEncodedTile(_tiff, chunk, pixels->data(), pixels->size()) < 0)
+      return nullptr;
+  }
+  else if (_scanlines)
+  {
+    // Codecs can not skip rows. Rows between the last one read and the band
+    // are decoded and dropped, a band above it restarts at its strip start.
+    uint32 firstRow = chunk * _chunkHeight;
+    uint32 rows = std::min(_chunkHeight, _height - firstRow);
+    uint32 stripStart = firstRow / _stripRows * _stripRows;
+    uint32 row = firstRow < _nextRow || _nextRow < stripStart ? stripStart : _nextRow;
+    tmsize_t lineSize = TIFFScanlineSize(_tiff);
+    std::vector<unsigned char> skipped(lineSize);
+    pixels = std::make_shared<std::vector<unsigned char>>((size_t)rows * lineSize);
+    _nextRow = _height; // Restart after a failed read
+    for (; row < firstRow + rows; row++)
+    {
+      unsigned char *line = row < firstRow ? skipped.data() : pixels->data() + (size_t)(row - firstRow) * lineSize;
+      if (TIFFReadScanline(_tiff, line, row) < 0)
+        return nullptr;
+    }
+    _nextRow = row;
+  }
+  else
+  {
+    pixels = std::make_shared<std::vector<unsigned char>>(TIFFStripSize(_tiff));
+    if (TIFFReadEncodedStrip(_tiff, chunk, pixels->data(), pixels->size()) < 0)
+      return nullptr;
+  }
+
+  _chunks.insert(chunk, pixels, pixels->size());
+  return pixels;
+}
+
+void TiffTileCache::setCapacity(size_t bytes)
+{
+  std::lock_guard<std::mutex> guard(_lock);
+  _chunks.setCapacity(bytes);
+}
+
+size_t TiffTileCache::getCapacity()
+{
+  return _chunks.getCapacity();
+}
+
+// Reads the pixels of a rectangle that may reach past the image into region,
+// decoding only the tiles or strips it touches. Pixels outside are zero.
+bool TiffTileCache::readRegion(int x, int y, uint32 width, uint32 height, unsigned char *region)
+{
+  uint32 pixelSize = _channels * _bps / 8;
+  memset(region, 0, (size_t)width * height * pixelSize);
+  if (_tiff == nullptr)
+    return false;
+
+  // Part of the rectangle inside the image
+  int64_t firstX = std::max<int64_t>(x, 0);
+  int64_t firstY = std::max<int64_t>(y, 0);
+  int64_t lastX = std::min<int64_t>((int64_t)x + width, _width);
+  int64_t lastY = std::min<int64_t>((int64_t)y + height, _height);
+  if (firstX >= lastX || firstY >= lastY)
+    return true;
+
+  bool ok = true;
+  for (int64_t chunkY = firstY / _chunkHeight * _chunkHeight; chunkY < lastY; chunkY += _chunkHeight)
+    for (int64_t chunkX = firstX / _chunkWidth * _chunkWidth; chunkX < lastX; chunkX += _chunkWidth)
+    {
+      std::shared_ptr<const std::vector<unsigned char>> chunk = getChunk(chunkY / _chunkHeight * _chunkColumns + chunkX / _chunkWidth);
+      if (chunk == nullptr)
+      {
+        ok = false;
+        continue;
+      }
+      int64_t fromX = std::max(firstX, chunkX);
+      int64_t toX = std::min<int64_t>(lastX, chunkX + _chunkWidth);
+      for (int64_t row = std::max(firstY, chunkY); row < std::min<int64_t>(lastY, chunkY + _chunkHeight); row++)
+      {
+        memcpy(region + ((row - y) * width + (fromX - x)) * pixelSize,
+               chunk->data() + ((row - chunkY) * _chunkWidth + (fromX - chunkX)) * pixelSize,
+               (toX - fromX) * pixelSize);
+      }
+    }
+  return ok;
+}
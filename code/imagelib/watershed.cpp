@@ -0,0 +1,200 @@
+#include "image.hpp"
+#include <queue>
+
+// Lower envelope of parabolas (Felzenszwalb/Huttenlocher): squared distance
+// along one line, f holds 0 on background and a large value elsewhere
+static void DistanceLine(const float *f, float *result, int length, std::vector<int> &vertices, std::vector<float> &bounds)
+{
+    if (length <= 0)
+        return;
+    const float infinity = std::numeric_limits<float>::max();
+    vertices.resize(length);
+    bounds.resize(length + 1);
+    int count = 0;
+    vertices[0] = 0;
+    bounds[0] = -infinity;
+    bounds[1] = infinity;
+    for (int q = 1; q < length; q++)
+    {
+        // Drop parabolas hidden below the new one, the first bound is -infinity
+        float s;
+        while (true)
+        {
+            int v = vertices[count];
+            s = ((f[q] + (float)q * q) - (f[v] + (float)v * v)) / (2.0f * (q - v));
+            if (s > bounds[count])
+                break;
+            count--;
+        }
+        count++;
+        vertices[count] = q;
+        bounds[count] = s;
+        bounds[count + 1] = infinity;
+    }
+
+    int vertex = 0;
+    for (int q = 0; q < length; q++)
+    {
+        while (bounds[vertex + 1] < q)
+            vertex++;
+        float offset = (float)(q - vertices[vertex]);
+        result[q] = offset * offset + f[vertices[vertex]];
+    }
+}
+
+void Image::DistanceTransform(unsigned char *data, float *distance)
+{
+    // Exact Euclidean distance of every foreground pixel to the nearest
+    // background pixel, separable into a column and a row pass
+    const float far = 1e20f;
+    unsigned int threads = getThreadCount();
+    RunInParallel(threads, [&](unsigned long job) {
+        std::vector<float> column(_height), result(_height), bounds;
+        std::vector<int> vertices;
+        for (uint32 x = job; x < _width; x += threads)
+        {
+            for (uint32 y = 0; y < _height; y++)
+            {
+                column[y] = data[y * _width + x] == MIN_INTENSITY ? 0.0f : far;
+            }
+            DistanceLine(column.data(), result.data(), _height, vertices, bounds);
+            for (uint32 y = 0; y < _height; y++)
+            {
+                distance[y * _width + x] = result[y];
+            }
+        }
+    });
+    RunInParallel(threads, [&](unsigned long job) {
+        std::vector<float> row(_width), bounds;
+        std::vector<int> vertices;
+        for (uint32 y = job; y < _height; y += threads)
+        {
+            float *line = distance + y * _width;
+            std::copy(line, line + _width, row.begin());
+            DistanceLine(row.data(), line, _width, vertices, bounds);
+            for (uint32 x = 0; x < _width; x++)
+            {
+                line[x] = sqrt(line[x]);
+            }
+        }
+    });
+}
+
+struct FloodPixel
+{
+    FloodPixel(float level, uint32 order, uint32 index) : Level(level), Order(order), Index(index){};
+    bool operator<(const FloodPixel &other) const
+    {
+        // Lowest level first, equal levels in insertion order
+        return Level != other.Level ? Level > other.Level : Order > other.Order;
+    }
+    float Level;
+    uint32 Order;
+    uint32 Index;
+};
+
+void Image::Watershed(float *relief, unsigned char *mask, std::vector<int> &labels)
+{
+    // Flooding from the labeled markers in order of increasing relief. Every
+    // mask pixel reached takes the label of the basin flooding it first.
+    uint32 pixelCount = _width * _height;
+    std::priority_queue<FloodPixel> queue;
+    uint32 order = 0;
+    for (uint32 index = 0; index < pixelCount; index++)
+    {
+        if (labels[index] != 0)
+            queue.push(FloodPixel(relief[index], order++, index));
+    }
+
+    // Neighbours no higher than the current level are flooded right away
+    // through a FIFO, only pixels above it go through the heap
+    std::queue<uint32> level;
+    float current = 0.0f;
+    while (!queue.empty() || !level.empty())
+    {
+        uint32 index;
+        if (!level.empty())
+        {
+            index = level.front();
+            level.pop();
+        }
+        else
+        {
+            index = queue.top().Index;
+            current = queue.top().Level;
+            queue.pop();
+        }
+        uint32 x = index % _width;
+        uint32 neighbours[4] = {index - 1, index + 1, index - (uint32)_width, index + (uint32)_width};
+        bool inside[4] = {x > 0, x < _width - 1, index >= _width, index + _width < pixelCount};
+        for (int neighbour = 0; neighbour < 4; neighbour++)
+        {
+            uint32 other = neighbours[neighbour];
+            if (!inside[neighbour] || labels[other] != 0 || mask[other] == MIN_INTENSITY)
+                continue;
+            labels[other] = labels[index];
+            if (relief[other] <= current)
+                level.push(other);
+            else
+                queue.push(FloodPixel(relief[other], order++, other));
+        }
+    }
+}
+
+void Image::SplitComponents(unsigned char *data, int depth)
+{
+    uint32 pixelCount = _width * _height;
+    float *distance = new float[pixelCount];
+    DistanceTransform(data, distance);
+
+    // Markers are the regional maxima of the distance after removing domes
+    // lower than depth (h-maxima), so a nucleus gets one marker per peak
+    unsigned char *peaks = new unsigned char[pixelCount];
+    unsigned char *domes = new unsigned char[pixelCount];
+    for (uint32 index = 0; index < pixelCount; index++)
+    {
+        peaks[index] = (unsigned char)std::min(distance[index] + 0.5f, (float)MAX_INTENSITY);
+        domes[index] = std::max(peaks[index] - depth, MIN_INTENSITY);
+    }
+    ReconstructByDilation(domes, peaks, N8);
+    for (uint32 index = 0; index < pixelCount; index++)
+    {
+        peaks[index] = std::max(domes[index] - 1, MIN_INTENSITY);
+    }
+    ReconstructByDilation(peaks, domes, N8);
+    for (uint32 index = 0; index < pixelCount; index++)
+    {
+        bool marker = domes[index] != MIN_INTENSITY && domes[index] != peaks[index];
+        peaks[index] = marker ? MAX_INTENSITY : MIN_INTENSITY;
+        distance[index] = -distance[index];
+    }
+
+    ComponentTable markers;
+    CCL(peaks, markers, N8);
+    std::vector<int> &labels = markers.Labels;
+    for (uint32 index = 0; index < pixelCount; index++)
+    {
+        if (markers.Intensity[labels[index]] != MAX_INTENSITY)
+            labels[index] = 0;
+    }
+
+    // Basins flood the components from the center out, where two meet one
+    // side is cut so the components no longer touch
+    Watershed(distance, data, labels);
+    for (uint32 index = 0; index < pixelCount; index++)
+    {
+        uint32 x = index % _width;
+        int label = labels[index];
+        if (label == 0)
+            continue;
+        if ((x < _width - 1 && labels[index + 1] != 0 && labels[index + 1] != label) ||
+            (index + _width < pixelCount && labels[index + _width] != 0 && labels[index + _width] != label))
+        {
+            data[index] = MIN_INTENSITY;
+        }
+    }
+
+    delete[] distance;
+    delete[] peaks;
+    delete[] domes;
+}
@@ -12,6 +12,8 @@
 using std::cout;
 using std::endl;
 
+const std::string FOURIER_WISDOM = "fftw.wisdom";
+
 void InvalidArguments();
 bool HandleInput(int argc, char **argv, QApplication *app, QtImageViewer *imv);
 
@@ -20,6 +22,10 @@ int main(int argc, char **argv)
   QApplication app(argc, argv);
   QtImageViewer *imv = new QtImageViewer();
 
+  // Measured plans are slow to make once, wisdom from earlier runs skips that
+  FourierPlans::setRigor(FFTW_MEASURE);
+  FourierPlans::loadWisdom(FOURIER_WISDOM);
+
   if (HandleInput(argc, argv, &app, imv) == false)
   {
     return 0;
@@ -29,6 +35,7 @@ int main(int argc, char **argv)
   imv->resize(1000, 600);
 
   int ret = app.exec();
+  FourierPlans::saveWisdom(FOURIER_WISDOM);
 
   delete (imv);
 